@@ -0,0 +1,64 @@
+#!/bin/sh
+# BENCH - size, memory and CPU of fronius builds, run on the board itself
+#
+# bench.sh [-t seconds] binary [binary ...] -- daemon arguments
+# eg	bench.sh -t 300 ./fronius.new ./fronius.tiny -- -n 3 -w 0 /dev/ttyAM0 5
+#
+# Each binary is run in turn for the time given (default 120s) against the same device and
+# controller number, so only one runs at a time. Records go to mcp and shm as in service, and
+# to a file sink too, where each inverter record counts as one polling cycle. Reports:
+#	bytes	file size			text/data/bss	from size(1) if there is one
+#	rss/hwm	resident kB at the end and at most	vsz	address space kB
+#	cpu	user + system mSec, all threads		ms/cycle	cpu per inverter record
+
+secs=120
+while getopts t: opt; do
+	case $opt in
+		t) secs=$OPTARG ;;
+		*) echo "Usage: bench.sh [-t seconds] binary ... -- daemon arguments" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+bins=
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+	bins="$bins $1"
+	shift
+done
+[ "$1" = "--" ] && shift
+if [ -z "$bins" ] || [ $# -eq 0 ]; then
+	echo "Usage: bench.sh [-t seconds] binary ... -- daemon arguments" >&2
+	exit 1
+fi
+out=/tmp/bench.$$
+hz=$(getconf CLK_TCK 2>/dev/null || echo 100)
+
+printf "%-20s %8s %8s %6s %6s %6s %6s %6s %8s %6s %9s\n" \
+	binary bytes text data bss rss hwm vsz cpu cycles ms/cycle
+for bin in $bins; do
+	rm -f $out
+	"$bin" -o mcp -o shm -o file:$out "$@" > /dev/null 2>&1 &	# As in service: older builds drop mcp and shm for any -o
+	pid=$!
+	sleep "$secs"
+	if ! kill -0 $pid 2> /dev/null; then
+		echo "$bin: exited early" >&2
+		continue
+	fi
+	set -- $(awk '/^VmRSS/ {r = $2} /^VmHWM/ {h = $2} /^VmSize/ {v = $2} END {print r + 0, h + 0, v + 0}' /proc/$pid/status) "$@"
+	rss=$1 hwm=$2 vsz=$3
+	shift 3
+	# Fields 14 and 15 of stat, counted from after the ) that ends the command name
+	cpu=$(sed 's/.*) //' /proc/$pid/stat | awk -v hz=$hz '{print int(($12 + $13) * 1000 / hz)}')
+	kill $pid
+	wait $pid 2> /dev/null
+	cycles=$(grep -c -e ' inverter ' -e ' data 9 ' $out 2> /dev/null)
+	text=- data=- bss=-
+	if command -v size > /dev/null 2>&1; then
+		set -- $(size "$bin" | awk 'NR == 2 {print $1, $2, $3}') "$@"
+		text=$1 data=$2 bss=$3
+		shift 3
+	fi
+	printf "%-20s %8d %8s %6s %6s %6d %6d %6d %8d %6d %9s\n" \
+		"$bin" $(wc -c < "$bin") $text $data $bss $rss $hwm $vsz $cpu ${cycles:-0} \
+		$(awk -v c=$cpu -v n=${cycles:-0} 'BEGIN {if (n) printf "%.2f", c / n; else print "-"}')
+done
+rm -f $out
@@ -11,7 +11,24 @@
 #include <getopt.h>     // for getopt
 #include <sys/mman.h>	// for PROT_READ
 #include <errno.h>      // For ETIMEDOUT
+#include <math.h>		// for sqrtf
+#include <pthread.h>	// for pthread_create
+#include <sys/socket.h> // for setsockopt
+#include <netinet/in.h> // for IPPROTO_TCP
+#include <netinet/tcp.h>	// for TCP_NODELAY
+#include <sys/un.h>		// for sockaddr_un
 #include "../Common/common.h"
+#include "fronius.h"
+#include "froniusdict.h"	// Generated from fronius.dict
+
+#ifdef TINY		// 1.59 Embedded build: the debug code goes, format strings and all
+#define TP(sub, id, ...) do { if (0) { int tpa_[] = {__VA_ARGS__}; (void) tpa_; } } while (0)
+#define TPDATA(sub, id, p, len) do { if (0) { (void) (p); (void) (len); } } while (0)
+#else			// 1.62 A tracepoint is one test of tpMask while its subsystem is off; no call, no clock read
+#define TP(sub, id, ...) do { if (__builtin_expect(tpMask & (sub), 0)) { \
+		int tpa_[] = {__VA_ARGS__}; tpRecord(sub, id, tpa_, sizeof(tpa_) / sizeof(int)); } } while (0)
+#define TPDATA(sub, id, p, len) do { if (__builtin_expect(tpMask & (sub), 0)) tpData(sub, id, p, len); } while (0)
+#endif
 
 /* Version 0.0 22/03/2007 Created by copying from Victron */
 // 0.1 29/04/2007 On-site corrections - ignore Exponent = 11 during Startup phase.
@@ -52,17 +69,55 @@
 // 1.35 28/03/2011 Improve handling of short packets that lead to large number of checksum errors.
 // 1.36 21/04/2011 Bugfix -n didn't work due to improper parameters to OpenSockets (When was this introduced?)
 // 1.37 02/02/2012 Bugfix - used Energy for Year not Energy Total.
+// 1.38 18/10/2026 Native TCP transport for hostname:portnum - NODELAY, keepalive, whole-frame writes, RTT based timeout.
+// 1.39 18/10/2026 Frame, reply and pacing timeouts from baud rate and per-inverter latency. -w now works; -w 0 = adaptive
+// 1.40 18/10/2026 ERRORSTATE handled as it arrives, even between commands. Repeats suppressed; fault events sent to server.
+// 1.41 18/10/2026 Fault history per inverter. GetFaults and GetFaultHistory commands.
+// 1.42 18/10/2026 Sanitycheck limits scaled by rated power plus running mean/deviation per value.
+// 1.43 18/10/2026 Latest readings, active inverters and faults published in shared memory. See fronius.h
+// 1.44 18/10/2026 Plant totals kept as values arrive and sent once per sweep of all inverters.
+// 1.45 18/10/2026 Energy integrated from power samples, kept within the Energy Total counter. Output as wh:
+// 1.46 18/10/2026 1 minute, 15 minute and daily mean/min/max of each value. GetRollup command.
+// 1.47 18/10/2026 Bus thread owns the serial device and timing; frames passed to the main thread through rings.
+// 1.48 18/10/2026 -M multiplexes all inverters over one server connection, one batch per sweep.
+// 1.49 18/10/2026 Commands accepted on every server connection, read incrementally without sleeping.
+// 1.50 18/10/2026 Batch command: many operations in one message, sent back-to-back, one reply. Queue now 64.
+// 1.51 18/10/2026 GetLatest answers from the last readings with their age. Refresh n [values] reads them next.
+// 1.52 18/10/2026 Device type and firmware of each active inverter found in the gaps between commands.
+//	Kept in /tmp/froniusN.inv; GetInfo command.
+// 1.53 18/10/2026 Device types, rated power, status texts, protocol errors and command names come from
+//	fronius.dict, made into froniusdict.h by mkdict.awk.
+// 1.54 18/10/2026 Resync on the next 80 80 80 after garbage in a burst. Replies shorter than their command
+//	needs are dropped. fuzzframe.c tests both.
+// 1.55 18/10/2026 Frames stamped on arrival from CLOCK_MONOTONIC; values carry that time, output as ts:
+// 1.56 18/10/2026 Bus broker: other tools send raw frames to /tmp/froniusN.bus and get the replies back.
+//	Their frames go in turn between ours, so diagnostics no longer mean stopping the daemon.
+// 1.57 18/10/2026 Output sinks chosen with -o: mcp, file, udp, shm. File and UDP sinks have their own queue
+//	and thread so a slow one loses records rather than holding up the bus. GetSinks command.
+// 1.58 18/10/2026 -o mcast:group:port sends each value as accepted in a binary datagram. See fronius.h
+// 1.59 18/10/2026 make tiny: -DTINY drops debug output and formats records without printf. Threads get
+//	small stacks. processComm and its buffer, unused since 1.47, removed. bench.sh measures it.
+// 1.60 18/10/2026 -a N[:values] reads those values of every inverter in one burst at each N second
+//	boundary, value by value, and reports how far apart the readings were.
+// 1.61 18/10/2026 The last TRACESIZE commands are kept with their times (queued, sent, first byte, complete,
+//	decoded, emitted). GetTrace gives them as Chrome trace JSON.
+// 1.62 18/10/2026 Tracepoints replace the DEBUG output: binary records in a buffer per thread, switched on
+//	by subsystem with Tracepoints tx,rx,decode,sanity,socket. Tracepoints dump writes them; fronius -T prints.
 // --
 // 2.0 30/05/2010 Uplift to 2.0
 
-#define REVISION "$Revision: 1.37 $"
-static char* id="@(#)$Id: fronius.c,v 1.37 2012/01/02 19:08:36 martin Exp $";
+#define REVISION "$Revision: 1.62 $"
+static char* id="@(#)$Id: fronius.c,v 1.62 2026/10/19 03:02:47 martin Exp $";
 
 #define PORTNO 10010
 #define PROGNAME "Fronius"
 #define LOGON "fronius"
 const char progname[] = "fronius";
 #define LOGFILE "/tmp/fronius%d.log"
+#define INFOFILE "/tmp/fronius%d.inv"	/* what discovery found, so it isn't asked again */
+#define BROKERSOCK "/tmp/fronius%d.bus"	/* local socket other tools send raw frames to */
+#define TRACEFILE "/tmp/fronius%d.json"	/* GetTrace file */
+#define TPFILE "/tmp/fronius%d.tp"		/* Tracepoints dump */
 #define SERIALNAME "/dev/ttyAM0"        /* although it MUST be supplied on command line */
 #define HOSTNAME "localhost"
 
@@ -80,14 +135,74 @@ int retrydelay = RETRYDELAY;
 #define SERIALNUMRETRIES 10
 #define SERIALRETRYDELAY 1000000 /*microseconds = 1 sec */
 #define WAITTIME 2      /*seconds*/
-// Set to if(0) to disable debugging
-// #define DEBUG if(debug)
-// #define DEBUG2 if(debug > 1)
-// #define DEBUGFP stderr   /* set to stderr or logfp as required */
+// Remote serial (hostname:portnum) params
+#define KEEPIDLE 30		/* seconds idle before first keepalive probe */
+#define KEEPINTVL 10	/* seconds between probes */
+#define KEEPCNT 3		/* probes lost before the extender is declared dead */
+#define FRAMETIMEOUT 100	/* mSec of silence marking end of frame. V1.33 value, used until RTT is known */
+#define MINFRAMETIMEOUT 20	/* allows for USB serial latency timers */
+#define MAXFRAMETIMEOUT 500
+// Adaptive timing (mSec)
+#define MINREPLY 200		/* never give up on a reply sooner than this */
+#define INITREPLY 2000		/* reply timeout before any latency is measured */
+#define MINPACE 50			/* minimum gap between commands */
+// Bus thread
+#define RINGSIZE 16			/* frames in flight each way. Power of 2 */
+#define THREADSTACK 65536	/* bus and sink threads. The default is 8MB of address space each */
+#define LOGRINGSIZE 8		/* log messages from the bus thread */
+// Multiplexed server connection
+#define BATCHSIZE 4096		/* one sweep of tagged records */
+// Server commands
+#define SOCKMSG 255			/* longest command accepted */
+// Bus broker
+#define MAXCLIENTS 4		/* tools sharing the bus at once */
+#define CLIENTQUEUE 4		/* frames a client may have waiting. More and it isn't read */
+// Output sinks
+#define MAXSINKS 6
+#define SINKQUEUE 64		/* records queued per sink unless queue= says */
+#define MAXSINKQUEUE 4096	/* .. and the most it may say */
+#define SINKREC 320			/* longest record, with its time and inv: prefix. aligned with every value is ~290 */
+// Trace
+#define TRACESIZE 256		/* commands remembered. Power of 2 */
+#define TRACEMSG 16000		/* longest GetTrace reply on the socket */
+#define TRACEDEFAULT 16		/* commands in it unless asked */
+// Tracepoints
+#define TPTHREADS 8			/* threads that may have a buffer */
+#define TPRECS 2048			/* records per thread, the oldest overwritten. Power of 2 */
+#define TPARGS 6			/* int arguments per record */
+#define TP_TX 1				/* subsystems, tpMask bits */
+#define TP_RX 2
+#define TP_DECODE 4
+#define TP_SANITY 8
+#define TP_SOCKET 16
+#define TP_ALL 31
+#define TPMAGIC 0x46525450	/* "FRTP" starts a dump */
 
 // This allows use of stdio instead of the serial device, and you can type in the hex value
 // #define DEBUGCOMMS
 
+// Fault handling
+#define MAXFAULTS 8			/* active faults tracked per inverter */
+#define FAULTWINDOW 300		/* seconds: a repeat of an active code within this is suppressed */
+#define FAULTCLEAR 900		/* seconds: an active code not repeated for this long is cleared */
+#define FAULTHISTORY 16		/* finished faults remembered per inverter */
+
+// Sanity checking
+#define DEFRATED 8000		/* Watts assumed when the device type is not known. Keeps the old 10000W limit */
+#define HEADROOM 1.25		/* allowed over rated power */
+#define STATSWARMUP 16		/* samples before the deviation test is used */
+#define STATSSTALE 3600		/* seconds: statistics older than this are restarted (eg overnight) */
+#define STATSK 6.0			/* deviations from the mean before a value is suspect */
+// Energy integration
+#define MAXGAP 900			/* seconds: don't integrate power across a longer gap */
+// Rollups
+#define NUMWINDOWS 3		/* 1 minute, 15 minutes, day */
+// Discovery
+#define DISCTRIES 3			/* unanswered queries before an inverter is left alone */
+#define DISC_TYPE 1			/* invInfo.known bits */
+#define DISC_VERSION 2
+#define DISC_ALL (DISC_TYPE | DISC_VERSION)
+
 #define VARSTART 0x10 /* First value to collect */
 #define VAREND  0x18 /* Last value to collect */
 #define MAXINVERTERS 12
@@ -100,7 +215,8 @@ enum Commands {GETVERSION = 1, GETDEVICETYPE, GETDATETIME, GETACTIVEINVERTERS,
 
 // System type
 enum {unset = 0, datalogger, ifceasy, rs485, lastType} systemType = unset;
-char *systemStr[] = {"unset", "Datalogger", "IFC Easy", "RS422", 0};
+// systemStr[] is in fronius.dict
+typedef char systemcheck[sizeof(systemStr) / sizeof(systemStr[0]) == lastType ? 1 : -1];
 
 int numInverters = 0;
 int currentInverter = 0;
@@ -108,12 +224,84 @@ unsigned char inverter[MAXINVERTERS] = {1};
 
 float responseVal[MAXINVERTERS][VAREND - VARSTART + 1];	// 9 values per inverter
 char count[MAXINVERTERS][VAREND - VARSTART + 1];	// Count for unlikely values
+struct stats {	// Running statistics of accepted values
+	float mean;			// exponentially weighted, 1/16
+	float var;			// exponentially weighted variance
+	int n;				// samples since (re)start
+	time_t last;		// time of last accepted sample
+} stats[MAXINVERTERS][VAREND - VARSTART + 1];
+int devType[MAXINVERTERS];	// From GetDevType, 0 = not known
+struct invinfo {	// What discovery has found out about each inverter, besides devType[]
+	int known;			// DISC_TYPE | DISC_VERSION
+	int tries;			// queries that went unanswered
+	unsigned char version[8];	// directed GETVERSION: card type, IFC x.y.z, SW a.b.c.d
+	time_t when;		// last learnt
+} invInfo[MAXINVERTERS];
+int discoverPending = 0;	// inverter with a discovery query out, 0 = none
+int discoverDue = 0;		// a sweep has finished: one query may go even if it doesn't fit the gap
+int busRtt[MAXINVERTERS + 1];	// Main's copy of each device's srtt + 4 rttvar, as the bus thread sends it. 0 = not measured
+int busGap = 0;				// .. and of paceTime()
+double sampleTime[MAXINVERTERS][VAREND - VARSTART + 1];	// When each responseVal arrived
+double rxTime = 0;			// When the frame being decoded arrived, 0 = not known
+
+struct {	// Plant totals across active inverters
+	double sum[VAREND - VARSTART + 1];	// Running sum of each responseVal over active inverters
+	float vacMin, vacMax;		// Spread of AC voltage this sweep
+	double first, last;			// Earliest and latest power sample this sweep
+} plant;
+
+struct integral {	// Energy integrated from power samples, per inverter
+	double wh;			// estimate of Energy Total, 0 = not started
+	double lastT;		// time of previous power sample
+	float lastW;		// previous power sample
+	float counter;		// last Energy Total reconciled against
+	float step;			// .. and its resolution, 10^exp Wh from the frame
+} energy[MAXINVERTERS];
+
+struct bucket {	// Summary of one value over one interval
+	time_t start;		// 0 = empty
+	double sum;
+	float min, max;
+	int count;
+};
+struct rollup {	// The interval in progress and the last complete one
+	struct bucket cur, prev;
+} rollup[MAXINVERTERS][VAREND - VARSTART + 1][NUMWINDOWS];
+int windowLen[NUMWINDOWS] = {60, 900, 86400};
+char * windowName[NUMWINDOWS] = {"1m", "15m", "day"};
+char * valueName[VAREND - VARSTART + 1] = {"watts", "wh", "whday", "whyear", "iac", "vac", "hz", "idc", "vdc"};
 int exponent[VAREND - VARSTART + 1] = {0, 3, 3, 3, -2, 0, -2, -2, 0};
 int exponenterror = 0;		// In exponent error mode?
 
+struct fault {	// An active fault on one inverter
+	int code;			// 0 = free slot
+	int class;			// 100, 300, 400, 500 or 700 as in statusText()
+	int extra;
+	time_t first, last;
+	int count;			// times seen since first
+} activeFault[MAXINVERTERS][MAXFAULTS];
+
+struct faultRing {		// Ring of faults that have cleared or been displaced, oldest overwritten
+	int next;			// slot for the next entry
+	int used;			// number of valid entries, up to FAULTHISTORY
+	struct fault entry[FAULTHISTORY];
+} faultHistory[MAXINVERTERS];
+
 enum CommandType { INVALID, GetVersion = 1, GetDevType, GetActiveInverters = 4, 
-	GetVals, ActivateError};
-char *CommandName[] = {"INVALID", "GetVersion", "GetDevType", "INVAL 3", "GetActiveInverters", "GetVals", "ActivateErrorForwarding"};
+	GetVals, ActivateError, Refresh, Aligned};
+// CommandName[] is in fronius.dict, which must keep up with this
+typedef char commandcheck[sizeof(CommandName) / sizeof(CommandName[0]) == Aligned + 1 ? 1 : -1];
+// 1.62 Tracepoints, by subsystem. Their names and how to print them are in fronius.dict too
+enum TracePoint { tpCommand, tpQueue, tpSequence, tpTxFrame, tpWrite, tpTxData, tpWriteFail, tpDiscover,
+	tpClient, tpErrorDay,
+	tpRead, tpRxData, tpBurst, tpRtt, tpTimeout, tpRxFrame, tpDropped,
+	tpPacket, tpShort, tpHeader, tpChecksum, tpValue, tpExponent, tpNext, tpSystem, tpActive, tpActivated,
+	tpRepeat, tpDiscovered, tpDevice, tpEnergy,
+	tpLimit, tpOutlier,
+	tpReadable, tpText, tpSend, tpRemote, tpBatch, tpActivate, tpBroker, tpLast};
+#ifndef TINY
+typedef char tracecheck[DICT_TRACE == tpLast ? 1 : -1];
+#endif
 /* To handle initiating ActivateErrorState. IF we are easInit, we are trying numbers one at a time until it succeeds, as part of the 
 start up sequence.  Once we have succeeded or failed, we go into easComplete and any ActivateErrorForwarding commands
 are being entered interactively */
@@ -137,16 +325,49 @@ struct {
         int     varID;                  // Which RAMVar or setting to read/write
         float varValue;         // Value read or to be written
 		int responseLength;		// Length of incoming packet
+		int target;				// inverter a queued command is for; 0 = current or broadcast
+		int scriptOp;			// operation number within the running Batch; 0 = not part of one
+		int resumeIndex;		// where a GetVals sequence cut short by a queued command carries on
+		int refreshMask;		// Refresh: bit per value, 1 << (index - VARSTART)
+		int replyFd;			// Refresh: who asked
 } staticInfo;
 
-#define QUEUESIZE 10
+#define QUEUESIZE 64		/* 1.50 - was 10. Room for a Batch covering every inverter */
 struct queue {
         int top, bottom;
         enum CommandType type[QUEUESIZE];
-        int  param[QUEUESIZE]; 
+        int  param[QUEUESIZE]; 		// target inverter
         float val[QUEUESIZE];
+        int arg1[QUEUESIZE], arg2[QUEUESIZE];	// ActivateError parameters; Refresh mask
+        int fd[QUEUESIZE];			// Refresh: connection to answer on
+        int op[QUEUESIZE];			// operation number within a Batch, 0 = single command
 } queue; 
 
+struct {	// The Batch command in progress
+	int id;				// 0 = none running
+	int fd;				// connection to answer on
+	char tag[32];		// caller's correlation tag, may be empty
+	int ops, done;
+	int len;
+	char result[BATCHSIZE];
+} script;
+int scriptSeq = 0;		// last Batch id issued
+
+struct {	// 1.60 -a: chosen values of every inverter read together at clock boundaries
+	int period;			// seconds, 0 = off
+	int mask;			// values, 1 << (index - VARSTART)
+	time_t next;		// the next boundary
+	time_t at;			// boundary of the burst in progress
+	int step, steps;	// position in the burst
+	int nvals, ninv;
+	int val[VAREND - VARSTART + 1];	// value indexes, in burst order
+	unsigned char inv[MAXINVERTERS];	// inverters, as active when the burst began
+	double first[VAREND - VARSTART + 1], last[VAREND - VARSTART + 1];	// spread of each value's arrival
+	int got;			// readings that came
+	float watts;		// sum of them
+} align;
+int txPace = -1;		// mSec gap before the next command sent, -1 = paceTime()
+
 /* Command line params: 
 1 - device name
 2 - controller num.
@@ -161,29 +382,147 @@ int errno;
 
 int inverterStatus, prevInverterStatus = -1;	// bitmask of active inverters.
 int servers = 1;
+int multiplex = 0;		// -M: one server connection for all inverters
+int numsockets = 1;		// connections open: servers, or 1 if multiplexed
+char batch[BATCHSIZE];	// Records waiting to go on the multiplexed connection
+int batchlen = 0, batchcount = 0;
+struct sockreader {	// Partial message from a server connection
+	int have;			// bytes of the current message so far, including the 2 byte length
+	int msglen;			// length of message body once known
+	unsigned char len[2];
+	char buf[SOCKMSG + 1];
+} reader[MAXINVERTERS];
 
 // Procedures used
 // int openSerial(const char * name, int baud, int parity, int databits, int stopbits);  // return fd
 // void closeSerial(int fd);  // restore terminal settings
 // void sockSend(const int fd, const char * msg);        // send a string
-void processComm(int commfd);           // get one byte from serial port
-int processSocket(void);                        // process server message
+int processSocket(int n);                       // read from server connection n
+void sockOpen(int start, int num);		// Connect to the servers and log on
+int sockReopen(int n);					// .. again for connection n when it closes
+int processCommand(int fd, char * buffer);		// act on one server message
+int isCommand(char * buffer, char * word);		// buffer is word, alone or with arguments
 void processPacket(unsigned char * buf);                // validate complete packet
 // void logmsg(int severity, char *msg);   // Log a message to server and file
-int sendSerial(int fd, unsigned char data);     // Send a byte
-int     sendCommand(int fd, unsigned char dev, unsigned char num, unsigned char cmd); // Send a command
-int     sendCommand2(int fd, unsigned char dev, unsigned char num, 
+int sendFrame(int fd, unsigned char * frame, int len);	// Send a complete frame (bus thread)
+int openComm(void);					// Open serial device or remote serial server
+int reopenComm(int fd);				// Reopen on the same fd
+float charTime(void);				// mSec to transmit one character at BAUD
+int replyTimeout(void);				// mSec to wait for a reply to the last command
+int paceTime(int waittime);			// mSec to pause between commands
+int msSince(struct timeval * tv);	// mSec elapsed
+int openRemote(const char * name);	// Connect to hostname:portnum
+void measureRtt(int sample);			// Note arrival of first byte of a reply
+int frameTimeout(void);				// mSec of silence marking end of frame
+int     sendCommand(unsigned char dev, unsigned char num, unsigned char cmd); // Send a command
+int     sendCommand2(unsigned char dev, unsigned char num, 
 	unsigned char cmd, unsigned char param1, unsigned char param2); // Send a command with 2 params
-int sendCommandN(int fd, unsigned char dev, unsigned char num, unsigned char cmd, int howmany, unsigned char * params);
+int sendCommandN(unsigned char dev, unsigned char num, unsigned char cmd, int howmany, unsigned char * params);
+int frameBuild(unsigned char * frame, unsigned char dev, unsigned char num, unsigned char cmd, int howmany, unsigned char * params);
 void usage(void);                                               // Standard usage message
-char * deviceType(int n);
+const char * deviceType(int n);
 char * getversion(void);			// Convert $REVISION$ macro
 char * getTime(void);			// formatted timestamp
-float sanitycheck(float value, int index, float prev, char * count);	// Check value against previous
-int getbuf(int fd, int max, int mSec);
-void dumpbuf();
-char * protocolError(int n);		// decode a protocol error return
-char * statusText(int n);			// decode a Status value
+int sanitycheck(float value, int index, int invnum, int exp);	// Check value against previous. 1 = accept
+int ratedPower(int n);				// Watts for a Device Type
+struct data;
+int getbuf(int fd, struct data * dp, int max, int mSec);
+int frameLength(unsigned char * buf, int avail);	// Length of the frame starting a burst
+const char * protocolError(int n);		// decode a protocol error return
+const char * statusText(int n);			// decode a Status value
+struct ring;
+int ringPut(struct ring * r, void * item);	// Single producer/single consumer queue
+int ringGet(struct ring * r, void * item);
+void busStart(int commfd);			// Start the bus thread
+void busStop(void);
+void * busThread(void * arg);		// Owns commfd
+int busSubmit(unsigned char * frame, int len, int pace, int idle);	// Queue a frame to be sent
+struct frame;
+void busTiming(struct frame * fp);	// Bus thread: put its timing in a frame for main
+void busLog(int severity, char * msg);	// logmsg from the bus thread
+int busPut(struct frame * fp);		// Bus thread: pass a frame to main
+void busLogDrain(void);				// .. done by the main thread
+void processError(unsigned char * msg);	// ERRORSTATE packet
+void expireFaults(void);			// Clear active faults that have not recurred
+void faultEvent(int invnum, struct fault * fp, char * what);	// Tell the server
+void faultRetire(int invnum, struct fault * fp);	// Move an active fault to the history
+void faultReport(int fd, char * cmd);	// Answer GetFaults or GetFaultHistory
+void shmOpen(void);					// Create the shared memory snapshot
+void shmPublish(int invnum);		// Update it for one inverter (0 = just the header)
+double timeNow(void);				// Seconds since the epoch, to the microsecond
+double monoNow(void);				// CLOCK_MONOTONIC seconds
+double realOffset(void);			// Add to a monoNow() time to get the time since the epoch
+void plantRecompute(void);			// Rebuild plant sums after the active inverters change
+void plantUpdate(int invnum, int i, float prev, float value);	// One value changed
+void plantSend(void);				// Emit totals at the end of a sweep
+int invSock(int invnum);			// Server connection for an inverter
+void batchAdd(int invnum, char * record);	// Queue a record for the multiplexed connection
+void batchFlush(void);				// Send the queued records in one message
+void energyUpdate(int invnum, int i, int exp);	// Integrate power or reconcile with Energy Total
+void rollupUpdate(int invnum, int i);	// Add the latest value to its buckets
+void rollupTick(time_t now);			// Close intervals that have ended with no sample
+time_t rollupStart(int w, time_t t);	// Start of the interval holding t
+void rollupRotate(struct rollup * rp, time_t start);	// Move on to the interval beginning at start
+void rollupReport(int fd, char * cmd);	// Answer GetRollup
+int queueOne(enum CommandType type, int target, int arg1, int arg2, int scripted);	// Add to the command queue
+int queueOp(char * op, int scripted);	// Parse one command and queue it
+int scriptStart(int fd, char * cmd);	// Queue a Batch
+void scriptResult(char * text);		// Record the outcome of one Batch operation
+void latestSend(int fd, int inv, int mask);	// Cached readings with their age
+void latestReport(int fd, char * cmd);	// Answer GetLatest
+void refreshQueue(int fd, char * cmd);	// Queue a Refresh
+void infoLoad(void);				// Read INFOFILE
+void infoSave(void);				// .. and write it
+void infoType(int inv, int type);	// Learnt a Device Type
+void infoVersion(int inv, unsigned char * v);	// Learnt the versions
+void discoverNext(void);			// Slip a query into the pacing gap if one is wanted
+void infoReport(int fd, char * cmd);	// Answer GetInfo
+void brokerOpen(void);				// Listen on BROKERSOCK
+void brokerClose(void);
+int brokerFds(fd_set * fds, int nfds);	// Add the broker's sockets to a select set
+void brokerPoll(fd_set * fds);		// Accept and read clients
+void brokerRead(int n);				// Read from client n
+void brokerParse(int n);			// Take complete frames from what it sent
+int brokerSend(void);				// Put a client frame on the bus if it is their turn
+void brokerDrop(int n, char * why);	// Close client n
+int sinkAdd(char * spec);			// -o type[:where][,queue=n][,drop=new|old]
+void sinkStart(void);				// Open the sinks and start their threads
+struct sink;
+int sinkOpen(struct sink * sp);		// Open a file or UDP sink
+void sinkStop(void);				// .. and write out what they have queued
+int sinkWanted(int type);			// Is a sink of this type configured?
+void sinkRecord(int invnum, char * record);	// Send a record to every sink
+void * sinkThread(void * arg);		// Writes a file or UDP sink
+void sinkReport(int fd);			// Answer GetSinks
+void mcastPublish(int invnum, int i);	// Send one value to the multicast sinks
+int alignParse(char * spec);		// -a N[:value,value..]
+int alignDue(void);					// A boundary has passed
+void alignBegin(void);				// Set up the burst
+int alignStep(void);				// Move on to the next reading, 0 when there are no more
+void alignReport(void);				// Send the skew record
+unsigned int traceBegin(unsigned char * buf, int idle);	// A command is being handed to the bus thread
+void traceDone(void);				// The main thread has finished with a reply
+void traceEmit(void);				// .. and something went out because of it
+void traceReport(int fd, char * cmd);	// Answer GetTrace
+int threadStart(pthread_t * tid, void * (*fn)(void *), void * arg);	// pthread_create with THREADSTACK
+int tpFloat(float f);				// A float argument for %F
+#ifndef TINY
+void tpRecord(int sub, int id, int * arg, int n);	// A tracepoint was hit with its subsystem on
+void tpData(int sub, int id, unsigned char * p, int len);	// .. with bytes, 16 to a record
+int tpParse(char * list);			// tx,rx,..|all|off to a tpMask, -1 if not understood
+int tpDump(char * name);			// Write every thread's records; return how many
+int tpCompare(const void * a, const void * b);	// qsort by time
+struct tprec;
+void tpPrint(struct tprec * rp);	// A record's text
+int tpDecode(char * name);			// fronius -T: print a dump
+void tpReport(int fd, char * cmd);	// Answer Tracepoints
+#endif
+#ifdef TINY
+char * fmtStr(char * p, const char * s);	// Append s at p, return the new end
+char * fmtInt(char * p, long n);
+char * fmtFixed(char * p, double v, int dp);	// As %.<dp>f
+char * fmtData(char * p, int invnum);	// The data line
+#endif
 
 // Globals
 FILE * logfp = NULL;
@@ -191,6 +530,15 @@ int sockfd[MAXINVERTERS];
 int debug = 0;
 int noserver = 0;               // Set to 1 to prevent socket connection.
 int BAUD = B19200;				// It's normally a #define
+int remote = 0;					// Set to 1 if serialName is hostname:portnum
+struct timeval frameSent;		// When the last command went out
+int rttPending = 0;				// Set when frameSent is waiting for a first byte
+int rttTarget = 0;				// Index into latency[] of the device the last command went to
+struct {	// Response latency per inverter (1-based); [0] is the Datalogger/broadcast
+	float srtt;		// smoothed mSec
+	float rttvar;	// mean deviation mSec
+	int samples;
+} latency[MAXINVERTERS + 1];
 
 #define BUFSIZE (10 + 12 + MAXINVERTERS)      /* A packet is up to 12 bytes except GetActiveInverters */
 // Common Serial Framework
@@ -199,12 +547,131 @@ struct data {	// The serial buffer
 	unsigned char buf[BUFSIZE];
 	int status;
 } data;
-unsigned char serialbuf[BUFSIZE];       // data accumulates in this global
-int serbufindex = 0;
+
+// 1.47 The bus thread and main thread share only these rings and pipes. Everything about
+// timing (latency, frameSent, pacing) belongs to the bus thread; decoding and output to main.
+struct frame {		// A frame each way between the threads
+	int count;			// bytes in buf. 0 on the rx side means the reply timed out
+	int reply;			// rx: the frame answered a command. tx: a reply is expected
+	int pace;			// tx: mSec gap before sending, -1 = paceTime()
+	int idle;			// tx: discovery query sent within the gap, which its reply doesn't restart.
+						// rx: reply = 2 for its answer
+	double rx;			// monoNow() when its first byte arrived
+	unsigned int id;	// 1.61 trace span of the command, 0 = not a reply
+	double sent, done;	// rx: when the command went, when its reply ended or timed out
+	int target;			// rx: latency[] index the last command went to
+	int rtt;			// rx: .. its srtt + 4 rttvar, 0 = not measured
+	int gap;			// rx: paceTime() then
+	unsigned char buf[BUFSIZE];
+};
+void traceRx(struct frame * fp);		// Note the bus thread's times for a reply
+void discoverPacket(struct frame * fp);	// Reply to a discovery query
+void brokerReply(struct frame * fp);	// Reply to a client's frame
+struct logline {	// A message the bus thread wants logged
+	int severity;
+	char text[200];
+};
+struct ring {		// Lock-free single producer, single consumer
+	volatile unsigned int head;	// written only by the producer
+	volatile unsigned int tail;	// written only by the consumer
+	int size;			// slots; power of 2
+	int itemsize;
+	char * slots;
+};
+struct frame rxSlots[RINGSIZE], txSlots[RINGSIZE];
+struct logline logSlots[LOGRINGSIZE];
+struct ring rxRing = {0, 0, RINGSIZE, sizeof(struct frame), (char *)rxSlots};
+struct ring txRing = {0, 0, RINGSIZE, sizeof(struct frame), (char *)txSlots};
+struct ring logRing = {0, 0, LOGRINGSIZE, sizeof(struct logline), (char *)logSlots};
+int busPipe[2] = {-1, -1};		// bus thread -> main: something in rxRing or logRing
+int wakePipe[2] = {-1, -1};		// main -> bus thread: something in txRing, or stop
+pthread_t busTid;
+int busRunning = 0;
+volatile int busQuit = 0;
+int rxDropped = 0;				// frames the bus thread lost to a full rxRing. Bus thread
+int waittime = WAITTIME;		// seconds. 0 = adaptive pacing
 int controllernum = 0;  // only used for logon message
 char buffer[256];
 char * serialName = SERIALNAME;
+struct fronius_shm * shm = NULL;	// Shared memory snapshot, NULL if not available
+// The snapshot layout is fixed by fronius.h
+typedef char mcastcheck[sizeof(struct fronius_mcast) == 24 ? 1 : -1];	// No padding on any target
+typedef char shmcheck[(MAXINVERTERS == FRONIUS_MAXINVERTERS && VAREND - VARSTART + 1 == FRONIUS_NUMVALS 
+	&& MAXFAULTS == FRONIUS_MAXFAULTS) ? 1 : -1];
 unsigned int errorParam1 = 2, errorParam2 = 0x55;	// This is suitable for Interface Card Easy
+struct client {	// A tool sharing the bus through BROKERSOCK
+	int fd;				// -1 = free slot
+	int have;			// bytes in buf
+	unsigned char buf[BUFSIZE];
+	unsigned int head, tail;	// frames waiting for a turn are q[head .. tail - 1], modulo CLIENTQUEUE
+	unsigned char q[CLIENTQUEUE][BUFSIZE];
+	int qlen[CLIENTQUEUE];
+	int sent, replies, timeouts, dropped;
+} client[MAXCLIENTS];
+int brokerFd = -1;			// listening socket, -1 = no broker
+int brokerNext = 0;			// client to look at first for the next turn
+int brokerTurn = 0;			// one of our commands has gone since the last client frame
+int brokerBusy = 0;			// a client frame is on the bus
+int brokerClient = -1;		// .. whose, -1 if it has gone since
+struct span {	// 1.61 One command's way through the daemon. monoNow() times, 0 = didn't happen
+	unsigned int id;	// 0 = unused
+	const char * kind;	// poll, discover or client
+	unsigned char dev, num, cmd;
+	int bytes;			// reply length, 0 = none came
+	double queued;		// handed to the bus thread
+	double sent;		// written to the device
+	double first;		// first byte of the reply
+	double complete;	// reply ended (frame timeout) or timed out
+	double decoded;		// main thread finished with it
+	double emitted;		// a record or datagram it led to went out
+} trace[TRACESIZE];
+unsigned int traceSeq = 0;		// last span id
+struct span * traceCur = NULL;	// span whose reply is being handled
+const char * traceKind = "poll";	// what the next command is for
+struct tprec {	// 1.62 One tracepoint hit. 40 bytes
+	volatile unsigned int seq;	// in its thread's buffer, from 1. 0 while being written
+	unsigned char id, sub;		// enum TracePoint, TP_ bit
+	unsigned char thread, spare;	// tpBuf index, set in the dump
+	double t;					// monoNow()
+	int arg[TPARGS];
+};
+struct tpbuf {	// A thread's tracepoints. Only that thread writes it
+	char name[8];
+	unsigned int seq;			// records written
+	struct tprec rec[TPRECS];
+} * tpBuf[TPTHREADS];
+struct tphead {		// Start of a dump; the records follow to the end of the file
+	unsigned int magic, version, recsize;
+	int controller;
+	double offset;				// realOffset() then
+	char name[TPTHREADS][8];	// the threads
+};
+volatile unsigned int tpMask = 0;	// subsystems on
+char * tpSubName[] = {"tx", "rx", "decode", "sanity", "socket"};	// by bit
+int tpThreads = 0;					// tpBuf[] slots claimed
+__thread struct tpbuf * tpMine = NULL;	// this thread's, once it has one
+__thread int tpNone = 0;			// .. or there wasn't room for it
+__thread const char * tpName = "main";
+enum SinkType {mcpSink, fileSink, udpSink, shmSink, mcastSink};
+char * sinkName[] = {"mcp", "file", "udp", "shm", "mcast"};
+struct sink {	// 1.57 Somewhere decoded records go
+	enum SinkType type;
+	char where[128];		// file name or host:port
+	int fd;
+	int size;				// queue slots
+	int dropOld;			// when full, drop the oldest record rather than the new one
+	int ttl;				// mcast: hops
+	char (*q)[SINKREC];
+	int head, count;		// q[head] is the oldest of count records
+	pthread_mutex_t lock;	// guards the queue and counts
+	pthread_cond_t more;
+	pthread_t tid;
+	int running;
+	int sent, dropped, failed;
+} sink[MAXSINKS];
+int numSinks = 0;
+volatile int sinkQuit = 0;
+unsigned int mcastSeq = 0;	// datagrams sent, for loss detection
 
 /********/
 /* MAIN */
@@ -219,7 +686,6 @@ int main(int argc, char *argv[])
 	int online = 1;                 // assume it's online to start with.
 	int option;                             // command line processing
 	int fake = 0;                   // send fake data
-	time_t commandSent;
 	int run = 1;
 	fd_set readfd; 
 	int numfds;
@@ -227,7 +693,8 @@ int main(int argc, char *argv[])
 	int tmout = 60;
 	int logerror = 0;
 	int i;
-	int waittime = WAITTIME;
+	time_t lastData;				// last time anything arrived from the bus
+	struct frame frame;				// from the bus thread
 	
 	// Turn off Red LED
 	blinkLED(0, REDLED);
@@ -237,8 +704,10 @@ int main(int argc, char *argv[])
 	
 	// Command line arguments
 	
+	sinkAdd("mcp");		// As before 1.57, unless -o nomcp or noshm
+	sinkAdd("shm");
 	opterr = 0;
-	while ((option = getopt(argc, argv, "dt:n:slfV0123ZON")) != -1) {
+	while ((option = getopt(argc, argv, "dt:n:slfV0123ZONw:Mo:a:T:")) != -1) {
 		switch (option) {
 			case '0': BAUD = B2400; break;
 			case '1': BAUD = B4800; break;
@@ -248,10 +717,16 @@ int main(int argc, char *argv[])
 			case 'l': nolog = 1; break;
 			case '?': usage(); exit(1);
 			case 't': tmout = atoi(optarg); break;
-			case 'd': debug++; break;
+			case 'd': debug++; tpMask = TP_ALL; break;	// 1.62 every tracepoint from the start
+#ifndef TINY
+			case 'T': exit(tpDecode(optarg) < 0);
+#endif
 			case 'f': fake = 1; break;
 			case 'n': servers = atoi(optarg); break;
 			case 'w': waittime = atoi(optarg); break;
+			case 'M': multiplex = 1; break;
+			case 'o': if (!sinkAdd(optarg)) { usage(); exit(1); } break;
+			case 'a': if (!alignParse(optarg)) { usage(); exit(1); } break;
 			case 'O': dataFormat = old; break;
 			case 'N': dataFormat = dataDictionary; break;
 			case 'V': printf("Version: %s %s\n", getversion(), id); exit(0);
@@ -278,17 +753,21 @@ int main(int argc, char *argv[])
 			controllernum, tmout, nolog ? "nolog" : "", fake ? "(fake)" : "");
 	logmsg(WARN, buffer);
 	
+	sprintf(buffer, "INFO " PROGNAME " %d Sinks:", controllernum);
+	for (i = 0; i < numSinks; i++)
+		sprintf(buffer + strlen(buffer), " %s%s%.40s", sinkName[sink[i].type], sink[i].where[0] ? ":" : "", sink[i].where);
+	logmsg(INFO, buffer);
+	if (sinkWanted(shmSink)) shmOpen();
+	infoLoad();
+
 	// initialise data
 	
 	queue.top = queue.bottom = 0;
 	
 	// Set up socket 
-	if (servers) {
-		if (dataFormat == old)
-			openSockets(0, servers, LOGON, REVISION, "", 0);
-		else
-			openSockets(0, servers, "inverter", REVISION, PROGNAME, 0);
-	}
+	numsockets = multiplex ? 1 : servers;
+	if (servers)
+		sockOpen(0, numsockets);
 	else
 		exit(0);
 	
@@ -298,7 +777,7 @@ int main(int argc, char *argv[])
 		time_t t;
 		time(&t);
 		tmp = localtime(&t);
-		DEBUG fprintf(DEBUGFP, "Using date as %d in ActivateError .. ", tmp->tm_mday);
+		TP(TP_TX, tpErrorDay, tmp->tm_mday);
 		errorParam1 = tmp->tm_mday;
 	}
 	
@@ -307,7 +786,7 @@ int main(int argc, char *argv[])
 	commfd = 0;
 #else
 	if (!fake) 
-        if ((commfd = openSerial(serialName, BAUD, 0, CS8, 1)) < 0) {
+        if ((commfd = openComm()) < 0) {
 			sprintf(buffer, "FATAL " PROGNAME " %d Failed to open %s at %d: %s", controllernum, serialName, BAUD, strerror(errno));
 			logmsg(FATAL, buffer);
         }
@@ -318,7 +797,7 @@ int main(int argc, char *argv[])
 		sprintf(buffer, "FATAL " PROGNAME " is already running, cannot start another one on %s", serialName);
 		logmsg(FATAL, buffer);
 	}
-
+	if (!fake) brokerOpen();		// 1.56 .. but other tools can share it through us
 
 	// If we failed to open the logfile and were NOT called with nolog, warn server
 	if (logfp == NULL && nolog == 0) {
@@ -326,8 +805,9 @@ int main(int argc, char *argv[])
 		sockSend(sockfd[0], buffer);
 	}
 	
-	numfds = (sockfd[0] > commfd ? sockfd[0] : commfd) + servers + 1;              // nfds parameter to select. One more than highest descriptor
-	DEBUG2 fprintf(DEBUGFP, "Numfds = %d Commfd = %d max Sockfd = %d", numfds, commfd, sockfd[0]);
+	sinkStart();
+	if (!fake) busStart(commfd);
+	
 	// Main Loop
 	FD_ZERO(&readfd); 
 	staticInfo.commandIndex = 0;
@@ -336,59 +816,112 @@ int main(int argc, char *argv[])
 	staticInfo.nextSequence = ActivateError;	// Was GetActiveInverters;
 	staticInfo.awaitReply = 0;
 	errorActivateState = easInit;		// This will initially send 02 from errorParam1, for Interface Card Easy.
-	commandSent = time(NULL);
+	lastData = time(NULL);
 	data.count = 0;
 	
 	//      sendInit(commfd);
 	while(run) {
 		
 		// Main loop
+		rollupTick(time(NULL));		// At night no sample comes to close the intervals
 		
+		if (staticInfo.commandComplete && brokerSend()) {	// 1.56 a client's frame between two of ours
+			staticInfo.awaitReply = 1;
+			staticInfo.commandComplete = 0;
+		}
 		if (staticInfo.commandComplete) {               // prepare to send next command 
-			DEBUG fprintf(DEBUGFP, "Command complete - pausing before next one ");
-			sleep(waittime);         // 1 or 2 seconds
+			// 1.47 The bus thread holds it back until the pacing gap has passed, reading
+			// error messages meanwhile. Was pauseBus() here, and sleep() before 1.40.
+			if (fake) usleep(paceTime(waittime) * 1000);
+			expireFaults();
+			if (!fake && alignDue() && staticInfo.currentSequence == GetVals)
+				staticInfo.sequenceComplete = 1;	// 1.60 the sweep resumes after the burst
 			if (staticInfo.sequenceComplete) {  // Set up for next sequence
 				staticInfo.sequenceComplete = 0;
-				if (queue.top != queue.bottom) {        // get command from queue
+				if (!fake && alignDue()) {		// Ahead of queued commands: it is the time that matters
+					if (staticInfo.currentSequence == GetVals && staticInfo.commandIndex > VARSTART
+						&& staticInfo.commandIndex <= staticInfo.commandLimit)
+						staticInfo.resumeIndex = staticInfo.commandIndex;
+					staticInfo.currentSequence = Aligned;
+					staticInfo.scriptOp = 0;
+					txPace = MINPACE;
+					alignBegin();
+				}
+				else if (queue.top != queue.bottom) {        // get command from queue
+					// 1.51 A sweep of an inverter cut short by the command carries on where it stopped
+					if (staticInfo.currentSequence == GetVals && staticInfo.commandIndex > VARSTART
+						&& staticInfo.commandIndex <= staticInfo.commandLimit)
+						staticInfo.resumeIndex = staticInfo.commandIndex;
 					queue.bottom++;
 					if (queue.bottom == QUEUESIZE) queue.bottom = 0;
-					DEBUG2 fprintf(DEBUGFP, "Queue len %d Getting command from index %d: %s\n", 
-								  queue.top - queue.bottom + 1, queue.bottom,
-								  CommandName[queue.bottom]);
+					TP(TP_TX, tpQueue, queue.type[queue.bottom], queue.param[queue.bottom],
+					   (queue.top - queue.bottom + QUEUESIZE) % QUEUESIZE);
 					staticInfo.currentSequence = queue.type[queue.bottom];
+					staticInfo.target = queue.param[queue.bottom];
+					staticInfo.scriptOp = queue.op[queue.bottom];
+					if (queue.type[queue.bottom] == ActivateError) {
+						errorParam1 = queue.arg1[queue.bottom];
+						errorParam2 = queue.arg2[queue.bottom];
+					}
+					if (queue.type[queue.bottom] == Refresh) {
+						staticInfo.refreshMask = queue.arg1[queue.bottom];
+						staticInfo.replyFd = queue.fd[queue.bottom];
+						for (i = VARSTART; !(staticInfo.refreshMask & (1 << (i - VARSTART))); i++) ;
+						staticInfo.commandIndex = i;
+						staticInfo.commandLimit = VAREND;
+					}
+					// 1.50 Batch operations go back-to-back: just the minimum gap
+					txPace = staticInfo.scriptOp ? MINPACE : -1;
 				}
 				else {          // in idle mode alternate between GetVals and GetActive Inverters.
 								// unless numinverters is zero, in which case keep querying until we get
 								// some active inverters.
 					staticInfo.currentSequence = staticInfo.nextSequence;
+					staticInfo.target = 0;
+					staticInfo.scriptOp = 0;
+					txPace = -1;
 					if (staticInfo.currentSequence == GetActiveInverters && numInverters > 0)
 						staticInfo.nextSequence = GetVals;
 					else
 						staticInfo.nextSequence = GetActiveInverters;
 				}
-				DEBUG2 fprintf(DEBUGFP, "\nNew Sequence %s then %s ", CommandName[staticInfo.currentSequence], 
-							  CommandName[staticInfo.nextSequence]);
+				TP(TP_TX, tpSequence, staticInfo.currentSequence, staticInfo.nextSequence);
 				
 				if (staticInfo.currentSequence == GetVals) {
 					staticInfo.commandLimit = VAREND;
-					staticInfo.commandIndex = VARSTART;
+					staticInfo.commandIndex = staticInfo.resumeIndex ? staticInfo.resumeIndex : VARSTART;
+					staticInfo.resumeIndex = 0;
 				}
 			}
-			commandSent = time(NULL);
+			if (!fake && queue.top == queue.bottom && !staticInfo.scriptOp && staticInfo.currentSequence != Refresh
+				&& staticInfo.currentSequence != Aligned)
+				discoverNext();		// 1.52 Goes ahead of this command, in the gap before it
 			switch(staticInfo.currentSequence) {
 				case GetVersion:
-					DEBUG fprintf(DEBUGFP, "\nCMD: GetVersion ");
-					sendCommand(commfd, 0, 0, GETVERSION);
+					TP(TP_TX, tpCommand, GetVersion, staticInfo.target, GETVERSION);
+					if (staticInfo.target)		// Directly addressed: interface card and software versions
+						sendCommand(1, staticInfo.target, GETVERSION);
+					else
+						sendCommand(0, 0, GETVERSION);
 					break;
 				case GetDevType:
-					DEBUG fprintf(DEBUGFP, "\nCMD: GetDevType of %d ", inverter[currentInverter]);
-					sendCommand(commfd, 1, inverter[currentInverter], GETDEVICETYPE);	break;
+					i = staticInfo.target ? staticInfo.target : inverter[currentInverter];
+					TP(TP_TX, tpCommand, GetDevType, i, GETDEVICETYPE);
+					sendCommand(1, i, GETDEVICETYPE);	break;
 				case GetActiveInverters:
-					DEBUG fprintf(DEBUGFP, "\nCMD: ActiveInverters ");
-					sendCommand(commfd, 0, 0, GETACTIVEINVERTERS);	break;
+					TP(TP_TX, tpCommand, GetActiveInverters, 0, GETACTIVEINVERTERS);
+					sendCommand(0, 0, GETACTIVEINVERTERS);	break;
 				case GetVals:
-					DEBUG fprintf(DEBUGFP, "\nCMD: GetVal %d for Inv %d ", staticInfo.commandIndex, inverter[currentInverter]);
-					sendCommand(commfd, 1, inverter[currentInverter], staticInfo.commandIndex);
+					TP(TP_TX, tpCommand, GetVals, inverter[currentInverter], staticInfo.commandIndex);
+					sendCommand(1, inverter[currentInverter], staticInfo.commandIndex);
+					break;
+				case Refresh:
+					TP(TP_TX, tpCommand, Refresh, staticInfo.target, staticInfo.commandIndex);
+					sendCommand(1, staticInfo.target, staticInfo.commandIndex);
+					break;
+				case Aligned:
+					TP(TP_TX, tpCommand, Aligned, staticInfo.target, staticInfo.commandIndex);
+					sendCommand(1, staticInfo.target, staticInfo.commandIndex);
 					break;
 				case ActivateError:
 					if (systemType == rs485) {	// Use ErrorSending
@@ -397,12 +930,12 @@ int main(int argc, char *argv[])
 						invs[0] = 0x55;		// Magic value to validate ErrorSending
 						for (i  = 1; i <= servers; i++)
 							invs[i] = i;
-						DEBUG fprintf(DEBUGFP, "\nCMD: ActivateErrorSending ");
-						sendCommandN(commfd, 0, 0, SETERRORSENDING, i, invs);
+						TP(TP_TX, tpCommand, ActivateError, 0, SETERRORSENDING);
+						sendCommandN(0, 0, SETERRORSENDING, i, invs);
 					} else {
 						// Should change this to use SendCommandN, and to use systemType to decide whether to send Date or 2.
-						DEBUG fprintf(DEBUGFP, "\nCMD: ActivateError %02x %02x ", errorParam1, errorParam2);
-						sendCommand2(commfd, 0, 0, SETERRORFORWARDING, errorParam1, errorParam2);
+						TP(TP_TX, tpCommand, ActivateError, 0, SETERRORFORWARDING);
+						sendCommand2(0, 0, SETERRORFORWARDING, errorParam1, errorParam2);
 					}
 					break;
 				default:
@@ -410,18 +943,27 @@ int main(int argc, char *argv[])
 			}
 			// Set awaitReply flag
 			staticInfo.awaitReply = 1;
+			staticInfo.commandComplete = 0;		// 1.47 - was left set, so any socket traffic re-sent the command
+			brokerTurn = 1;
 		}
+		// 1.47 The bus thread times out replies (1.39) and tells us with an empty frame
 		timeout.tv_sec = tmout;
 		timeout.tv_usec = 0;
-		data.count = 0;
-		bzero(data.buf, sizeof(data.buf));
-		for (i = 0; i < servers; i++)
+		FD_ZERO(&readfd);
+		numfds = busPipe[0];		// nfds parameter to select. One more than highest descriptor
+		for (i = 0; i < numsockets; i++) {	// A connection reopened may have a new fd
 			FD_SET(sockfd[i], &readfd);
-		if (!fake)      FD_SET(commfd, &readfd);
-		if (select(numfds, &readfd, NULL, NULL, &timeout) == 0) {       // select timed out. Bad news 
+			if (sockfd[i] > numfds) numfds = sockfd[i];
+		}
+		numfds++;
+		if (!fake)      FD_SET(busPipe[0], &readfd);
+		if (select(brokerFds(&readfd, numfds), &readfd, NULL, NULL, &timeout) == 0) {       // select timed out. Bad news 
 			// Set CommandComplete so it moves onto next command in sequence
 			staticInfo.commandComplete = 1;
 			staticInfo.sequenceComplete = 1;
+			if (staticInfo.scriptOp) scriptResult("no reply");
+			if (staticInfo.currentSequence == Refresh)
+				latestSend(staticInfo.replyFd, staticInfo.target, staticInfo.refreshMask);
 			if (fake) {
 				if (dataFormat == old)
 					sockSend(sockfd[0], "data 9 1.0 2.0 3.0 4.0 5.0 6.0 7.0 8.0 9.0");
@@ -433,46 +975,96 @@ int main(int argc, char *argv[])
 					logmsg(WARN, buffer);
 					online = 0;     // prevent recurring messages
 				}
-			
 			continue;
 		}
 		// Want to loop here consuming anything from the Fronius
-		if (!fake)
-			while (FD_ISSET(commfd, &readfd)) {
-				int num;
+		if (!fake && FD_ISSET(busPipe[0], &readfd)) {
+			char drain[RINGSIZE];
+			read(busPipe[0], drain, sizeof(drain));
+			busLogDrain();
+			while (ringGet(&rxRing, &frame)) {
+				traceDone();		// The frame before
+				traceRx(&frame);
+				TP(TP_RX, tpRxFrame, frame.count, frame.reply, frame.id);
+				busRtt[frame.target] = frame.rtt;
+				busGap = frame.gap;
+				if (frame.reply == 2) {		// Discovery, nothing to do with the current command
+					discoverPacket(&frame);
+					continue;
+				}
+				if (frame.reply && brokerBusy) {	// Answer to a client's frame, or its timeout
+					brokerReply(&frame);
+					staticInfo.commandComplete = 1;		// ours carry on as they were
+					staticInfo.awaitReply = 0;
+					if (frame.count) {
+						online = 1;
+						lastData = time(NULL);
+					}
+					continue;
+				}
+				if (frame.count == 0) {		// Reply timed out
+					staticInfo.commandComplete = 1;
+					staticInfo.sequenceComplete = 1;	// 1.15 move onto the next command
+					if (staticInfo.currentSequence == Aligned)		// .. which in a burst is the next reading
+						staticInfo.sequenceComplete = !alignStep();
+					staticInfo.awaitReply = 0;
+					if (staticInfo.scriptOp) scriptResult("no reply");
+					if (staticInfo.currentSequence == Refresh)	// Answer with what we have; ages tell
+						latestSend(staticInfo.replyFd, staticInfo.target, staticInfo.refreshMask);
+					if (online && time(NULL) >= lastData + tmout) {
+						sprintf(buffer, "WARN " PROGNAME " %d No data for last period", controllernum);
+						logmsg(WARN, buffer);
+						online = 0;     // prevent recurring messages
+					}
+					continue;
+				}
 				blinkLED(1, REDLED);
 				online = 1;     // back on line
-				num = getbuf(commfd, 50, 100);		// V1.33 - change from 10 to 100msEc due to using serial externder
-				DEBUG fprintf(stderr,"Getbuf: %d (%d)\n", num, data.count);
-				DEBUG dumpbuf();
-				// processComm(commfd);
-				processPacket(data.buf);
-				FD_SET(commfd, &readfd);
-				timeout.tv_sec = 0;
-				timeout.tv_usec = 10000;        // see if another character is on its way.  (10mSec)
-				select(commfd+1, &readfd, NULL, NULL, &timeout);
-				// DEBUG fprintf(DEBUGFP, "%s", FD_ISSET(commfd, &readfd) ? "Y" : "N");
+				lastData = time(NULL);
+				data.count = frame.count;
+				memcpy(data.buf, frame.buf, sizeof(data.buf));
+				rxTime = frame.rx + realOffset();
+				if (frame.reply) {
+					processPacket(data.buf);
+					if (!staticInfo.commandComplete) {	// Garbled reply: as a timeout
+						staticInfo.commandComplete = 1;
+						staticInfo.sequenceComplete = staticInfo.currentSequence == Aligned ? !alignStep() : 1;
+						staticInfo.awaitReply = 0;
+					}
+					if (staticInfo.scriptOp) scriptResult("unexpected reply");
+				} else if (data.count >= 8 && data.buf[6] == ERRORSTATE)
+					processPacket(data.buf);			// 1.40 handled as soon as it arrives
+				else
+					TP(TP_RX, tpDropped, data.count);
+				blinkLED(0, REDLED);
 			}
-			blinkLED(0, REDLED);
-		
-		if ((noserver == 0) && FD_ISSET(sockfd[0], &readfd)) {
-			DEBUG fprintf(DEBUGFP, "\nCalling ProcessSocket (fd %d)\n", sockfd[0]);
-			run = processSocket();  // the server may request a shutdown so set run to 0
+			traceDone();
 		}
-		// DEBUG fprintf(DEBUGFP, "AwaitReply: %d ", staticInfo.awaitReply);
-		if (staticInfo.awaitReply == 1 && time(NULL) < commandSent + WAITTIME) { //waiting .. 
-			DEBUG2 fprintf(DEBUGFP, "looping .. ");
+		
+		if (noserver == 0)
+			for (i = 0; i < numsockets && run; i++)
+				if (FD_ISSET(sockfd[i], &readfd)) {
+					TP(TP_SOCKET, tpReadable, i, sockfd[i]);
+					run = processSocket(i);  // the server may request a shutdown so set run to 0
+				}
+		brokerPoll(&readfd);
+		if (staticInfo.awaitReply == 1) //waiting .. the select above times out the reply
 			continue;
-		}
-		if (staticInfo.awaitReply == 1 && time(NULL) > commandSent + WAITTIME) { //timeout
-			DEBUG fprintf(DEBUGFP, "\n*** Timeout %d ***\n", WAITTIME);
-		}
 		if (fake) continue;
 	}
 	sprintf(buffer,"INFO " PROGNAME " %d Shutdown requested", controllernum);
 	logmsg(INFO, buffer);
-	for (i = 0; i < servers; i++)
+	for (i = 0; i < numsockets; i++)
 		close(sockfd[i]);
+	busStop();
+	sinkStop();
+	brokerClose();
+#ifndef TINY
+	if (tpMask) {		// Whatever was being traced led up to this
+		sprintf(buffer, TPFILE, controllernum);
+		tpDump(buffer);
+	}
+#endif
 	closeSerial(commfd);
 	return 0;
 }
@@ -481,250 +1073,303 @@ int main(int argc, char *argv[])
 /* USAGE */
 /*********/
 void usage(void) {
-        printf("Usage: fronius [-t timeout] [-l] [-s] [-d] [-f] [-V] [O|N] [-01234] [-n XXX] [-w n] /dev/ttyname controllernum \n");
-        printf("-l: no log  -s: no server  -d: debug on -f: fake data -V version -n number of slaves (0 for a slave) -w wait time\n");
+        printf("Usage: fronius [-t timeout] [-l] [-s] [-d] [-f] [-V] [O|N] [-01234] [-n XXX] [-w n] [-M] /dev/ttyname|host:port controllernum \n");
+        printf("-l: no log  -s: no server  -d: debug on -f: fake data -V version -n number of slaves (0 for a slave) -w wait time (0 = adaptive)\n");
+        printf("-M: one multiplexed server connection for all inverters\n");
+        printf("-o file:name|udp:host:port[,queue=n][,drop=new|old]: send records there too; may be repeated. Queue 1-4096, default 64\n");
+        printf("-o nomcp|noshm: not to the server connection, or shared memory, which are always used otherwise\n");
+        printf("-o mcast:group:port[,ttl=n]: each value as accepted, in a datagram as fronius.h\n");
+        printf("-a N[:watts,iac,..]: read these (default watts) from every inverter together each N seconds\n");
+        printf("Other tools may send raw frames to /tmp/froniusN.bus and read the replies\n");
 		printf("Speed: 0=2400, 1=4800, 2=9600, 3=14400; 4=19200 format: O[ld] N[ew]\n");
         return;
 }
 
-/**************/
-/* SENDSERIAL */
-/**************/
-int sendSerial(int fd, unsigned char data) {
-	// Send a single byte.  Return 1 for a logged failure
+/*************/
+/* SENDFRAME */
+/*************/
+int sendFrame(int fd, unsigned char * frame, int len) {
+	// Send a complete frame in one write.  Return 1 for a logged failure
+	// 1.38 - was one byte per syscall, which over a serial extender meant one TCP segment per byte.
+	// 1.47 - runs on the bus thread so logs with busLog
+	char msg[200];
 	int retries = SERIALNUMRETRIES;
-	int written;
-	int newfd;
+	int written = 0, now;
 #ifdef DEBUGCOMMS
-	fprintf(DEBUGFP, "Comm 0x%02x(%d) ", data, data);
+	int i;
+	for (i = 0; i < len; i++)
+		fprintf(DEBUGFP, "Comm 0x%02x(%d) ", frame[i], frame[i]);
 	return 0;
 #endif
 	
-	DEBUG2 fprintf(DEBUGFP, "%02x ", data);
-	while ((written = write(fd, &data, 1)) < 1) {
-        fprintf(DEBUGFP, "Serial wrote %d bytes errno = %d", written, errno);
-		sprintf(buffer, "WARN " PROGNAME " %d SendSerial: Failed to write data: %s", controllernum, strerror(errno));
-		logmsg(INFO, buffer);
-		close(fd);
-		newfd = openSerial(serialName, BAUD, 0, CS8, 1);
-		if (newfd < 0) {
-			sprintf(buffer, "WARN " PROGNAME " %d SendSerial: Error reopening serial/port: %s ", controllernum, strerror(errno));
-			logmsg(WARN, buffer);
-		}
-		if (newfd != fd) {
-			sprintf(buffer, "WARN " PROGNAME " %d SendSerial: Problem reopening socket - was %d now %d", controllernum, fd, newfd);
-			logmsg(WARN, buffer);
-			return 1;
+	TP(TP_TX, tpWrite, len);		// 1.62 was a fprintf per byte, which upset the timing it was there to show
+	TPDATA(TP_TX, tpTxData, frame, len);
+	while (written < len) {
+		if ((now = write(fd, frame + written, len - written)) > 0) {
+			written += now;
+			continue;
 		}
+		TP(TP_TX, tpWriteFail, now, errno, retries - 1);
+		sprintf(msg, "WARN " PROGNAME " %d SendFrame: Failed to write data: %s", controllernum, strerror(errno));
+		busLog(INFO, msg);
+		if (reopenComm(fd) != fd) return 1;
 		if (--retries == 0) {
-			sprintf(buffer, "WARN " PROGNAME " %d SendSerial: too many retries", controllernum);
-			logmsg(WARN, buffer);
+			sprintf(msg, "WARN " PROGNAME " %d SendFrame: too many retries", controllernum);
+			busLog(WARN, msg);
 			return 1;
 		}
-		DEBUG fprintf(DEBUGFP, "SendSerial retry pausing %d ... ", SERIALRETRYDELAY);
 		usleep(SERIALRETRYDELAY);
+		written = 0;		// Whole frame again - the other end will have discarded the fragment
 	}
+	gettimeofday(&frameSent, NULL);
+	rttPending = 1;
+	rttTarget = (frame[4] == 1 && frame[5] <= MAXINVERTERS) ? frame[5] : 0;		// Option 1 = inverter; 0 = Datalogger
 	return 0;       // ok
 }
 
 /***************/
 /* SENDCOMMAND */
 /***************/
-int sendCommand(int fd, unsigned char dev, unsigned char num, unsigned char cmd) {
+int sendCommand(unsigned char dev, unsigned char num, unsigned char cmd) {
 	// As before, return 1 for a logged failure, otherwise 0
-	unsigned char   checksum;
-	
-	DEBUG2 fprintf(DEBUGFP, "\n%s SendCommand: dev/opt %d num %d (0x%02x) cmd %d (0x%02x) \n", getTime(), dev, num, num, cmd, cmd);
-#ifndef DEBUGCOMMS
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x00)) return 1;	// Length : always 00 for sent commands
-	if (sendSerial(fd, dev)) return 1;
-	if (sendSerial(fd, num)) return 1;
-	if (sendSerial(fd, cmd)) return 1;
-	checksum = dev + num + cmd;
-	if (sendSerial(fd, checksum & 0xFF)) return 1;
-#endif
-	return 0;
+	return sendCommandN(dev, num, cmd, 0, NULL);
 }
 
 /****************/
 /* SENDCOMMAND2 */
 /****************/
 // Send command with 2 parameters
-int sendCommand2(int fd, unsigned char dev, unsigned char num, unsigned char cmd, unsigned char param1, unsigned char param2) {
+int sendCommand2(unsigned char dev, unsigned char num, unsigned char cmd, unsigned char param1, unsigned char param2) {
 	// As before, return 1 for a logged failure, otherwise 0
-	unsigned char   checksum;
+	unsigned char params[2];
 	
-	DEBUG2 fprintf(DEBUGFP, "\n%s SendCommand2: dev/opt %d num %d (0x%02x) cmd %d (0x%02x) p1 %d (0x%02x) p2 %d (0x%02x) \n",
-		getTime(), dev, num, num, cmd, cmd, param1, param1, param2, param2);
-#ifndef DEBUGCOMMS
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x02)) return 1;	// Length : 02 for ActivateErrorForwarding
-	if (sendSerial(fd, dev)) return 1;
-	if (sendSerial(fd, num)) return 1;
-	if (sendSerial(fd, cmd)) return 1;
-	if (sendSerial(fd, param1)) return 1;
-	if (sendSerial(fd, param2)) return 1;
-	checksum = 2 + dev + num + cmd + param1 + param2;
-	if (sendSerial(fd, checksum & 0xFF)) return 1;
-#endif
-	return 0;
+	params[0] = param1;
+	params[1] = param2;
+	return sendCommandN(dev, num, cmd, 2, params);	// Length : 02 for ActivateErrorForwarding
 }
 
 /*****************/
 /* SENDCOMMAND N */
 /*****************/
 // Send command with N parameters
-int sendCommandN(int fd, unsigned char dev, unsigned char num, unsigned char cmd, int howmany, unsigned char * params) {
+int sendCommandN(unsigned char dev, unsigned char num, unsigned char cmd, int howmany, unsigned char * params) {
 	// As before, return 1 for a logged failure, otherwise 0
+	// 1.38 - assemble the whole frame and hand it to sendFrame
+	// 1.47 - .. on the bus thread, which owns the device
+	unsigned char frame[BUFSIZE];
+	int len;
+	
+	if ((len = frameBuild(frame, dev, num, cmd, howmany, params)) == 0)
+		return 1;
+	return busSubmit(frame, len, txPace, 0);
+}
+
+/**************/
+/* FRAMEBUILD */
+/**************/
+int frameBuild(unsigned char * frame, unsigned char dev, unsigned char num, unsigned char cmd, int howmany, unsigned char * params) {
+	// Assemble a command in frame, BUFSIZE long. Return its length, 0 for a logged failure.
 	unsigned char   checksum;
 	int i;
 	
-	DEBUG2 fprintf(DEBUGFP, "\n%s SendCommandN: dev/opt %d num %d (0x%02x) cmd %d (0x%02x) N=%d \n",
-				   getTime(), dev, num, num, cmd, cmd, howmany);
-#ifndef DEBUGCOMMS
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, 0x80)) return 1;
-	if (sendSerial(fd, howmany)) return 1;	// Length : 02 for ActivateErrorForwarding
-	if (sendSerial(fd, dev)) return 1;
-	if (sendSerial(fd, num)) return 1;
-	if (sendSerial(fd, cmd)) return 1;
+	if (howmany < 0 || howmany + 8 > BUFSIZE) {
+		sprintf(buffer, "ERROR " PROGNAME " %d SendCommandN: %d parameters is too many", controllernum, howmany);
+		logmsg(ERROR, buffer);
+		return 0;
+	}
+	TP(TP_TX, tpTxFrame, dev, num, cmd, howmany);
+	frame[0] = frame[1] = frame[2] = 0x80;
+	frame[3] = howmany;		// Length : always 00 for plain commands
+	frame[4] = dev;
+	frame[5] = num;
+	frame[6] = cmd;
 	checksum = howmany + dev + num + cmd;
 	for (i = 0; i < howmany; i++) {
-		sendSerial(fd, params[i]);
+		frame[7 + i] = params[i];
 		checksum += params[i];
 	}
-	if (sendSerial(fd, checksum & 0xFF)) return 1;
-#endif
-	return 0;
+	frame[7 + howmany] = checksum & 0xFF;
+	return howmany + 8;
 }
 
-/***************/
-/* PROCESSCOMM */
-/***************/
-void processComm(int commfd) {
-	// Deal with just one byte.
-	// It's easier to do it this way than read a lot then scan for the newline.
-	// When we have all the bytes in the buffer, process the packet
-	staticInfo.commandComplete = 0; // Always set this to FALSE on entry
-	unsigned char thischar;
-	int numread;
-	static int commserr = 0;
-	
-	if (serbufindex + 1 == BUFSIZE) {
-		sprintf(buffer, "WARN " PROGNAME " %d buffer overflow - discarding packet", controllernum);
-		logmsg(WARN, buffer);
-		serbufindex = 0;
-		return;
-	}
-	
-#ifdef DEBUGCOMMS
-	{  int val;
-//		char buf[20];
-		numread = scanf("%x", &val);
-//        gets(buf);
-//        val = strtol(buf, NULL, 16);
-        fprintf(DEBUGFP, " Got %02x ", val);
-        serialbuf[serbufindex] = val;
+/************/
+/* OPENCOMM */
+/************/
+int openComm(void) {
+	// Open the serial device, or if the name is hostname:portnum the remote serial server.
+	if (strchr(serialName, ':')) {
+		remote = 1;
+		return openRemote(serialName);
 	}
-#else
-tryagain:
-	 numread = read(commfd, &serialbuf[serbufindex], 1);       // must be able to read at least one byte otherwise the 
-															// fd would not be readable.
-	if (numread == 0) {
-		sprintf(buffer, "WARN " PROGNAME " %d read 0 bytes", controllernum);
-		logmsg(WARN, buffer);
-		sleep(1);
-		return;
+	return openSerial(serialName, BAUD, 0, CS8, 1);
+}
+
+/**************/
+/* REOPENCOMM */
+/**************/
+int reopenComm(int fd) {
+	// Close and reopen the device, keeping the same fd number as the main loop holds it.
+	// Returns fd, or -1 having logged the failure. Bus thread.
+	char msg[200];
+	int newfd;
+	close(fd);
+	if ((newfd = openComm()) < 0) {
+		sprintf(msg, "WARN " PROGNAME " %d Error reopening %s: %s ", controllernum, serialName, strerror(errno));
+		busLog(WARN, msg);
+		return -1;
 	}
-	DEBUG2 fprintf(stderr, "<%02x ", serialbuf[serbufindex]);
-	if (numread < 1) {
-		int newfd;
-		sprintf(buffer, "WARN " PROGNAME " %d ProcessComm: error reading from %s: %s. Reopening.", controllernum, 
-			serialName, strerror(errno));
-		logmsg(WARN, buffer);
-		
-		close(commfd);
-		newfd = openSerial(serialName, BAUD, 0, CS8, 1);
-		if (newfd < 0) perror("Reopening serial/port (FROM) ");
-		if (newfd != commfd) {
-			sprintf(buffer, "WARN " PROGNAME " %d Problem reopening socket - was %d now %d\n", controllernum, commfd, newfd);
-			return;
+	if (newfd != fd) {
+		if (dup2(newfd, fd) < 0) {
+			sprintf(msg, "WARN " PROGNAME " %d Problem reopening %s - was %d now %d", controllernum, serialName, fd, newfd);
+			busLog(WARN, msg);
+			close(newfd);
+			return -1;
 		}
-		sleep(1);
-		goto tryagain;
+		close(newfd);
 	}
+	if (remote) flock(fd, LOCK_EX | LOCK_NB);
+	rttPending = 0;
+	return fd;
+}
+
+/**************/
+/* OPENREMOTE */
+/**************/
+int openRemote(const char * name) {
+	// Connect to hostname:portnum and tune the connection for small request/response frames:
+	// no Nagle delay and keepalive probes so a dead extender is noticed.
+	char host[128];
+	char * cp;
+	struct hostent * hp;
+	struct sockaddr_in addr;
+	int fd, one = 1, nodelay, keepalive;
 	
+	strncpy(host, name, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	if ((cp = strchr(host, ':')) == NULL) return -1;
+	*cp++ = '\0';
+	if ((hp = gethostbyname(host)) == NULL) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(cp));
+	memcpy(&addr.sin_addr, hp->h_addr, sizeof(addr.sin_addr));
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	nodelay = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0 ? errno : 0;
+	keepalive = setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) < 0 ? errno : 0;
+#ifdef TCP_KEEPIDLE
+	{	int idle = KEEPIDLE, intvl = KEEPINTVL, cnt = KEEPCNT;
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+	}
 #endif
-	 thischar = serialbuf[serbufindex];
-	switch(serbufindex) {           // perform specific checks on each byte
-		case 0:
-		case 1:
-		case 2:              
-			if (thischar != 0x80) {
-				if (!commserr) {
-					sprintf(buffer, "WARN " PROGNAME " %d failed to read header byte %d as 0x80 - got 0x%02x", controllernum, serbufindex, thischar);
-					logmsg(WARN, buffer);
-					commserr = 1;
-				}
-				serbufindex = 0;
-				commserr ++;
-				if (commserr % 100 == 0) {
-					sprintf(buffer, "WARN " PROGNAME " %d - %d non-header bytes", controllernum, commserr);
-					logmsg(WARN, buffer);
-				}
-			}
-			else {
-				if (commserr) {
-					sprintf(buffer, "INFO " PROGNAME " %d exiting comms error mode after %d non-header bytes", controllernum, commserr);
-					logmsg(INFO, buffer);
-					commserr = 0;
-				}
-				serbufindex++;
-			}
-			break;
-			case 3:         // length byte.  Increase packet length to 10.
-			staticInfo.responseLength = thischar;	// and fall through.
-			if (thischar > MAXINVERTERS) {
-				sprintf(buffer, "WARN " PROGNAME " %d got length as %d (Max is %d) - discarding packet", controllernum, thischar, MAXINVERTERS);
-				logmsg(WARN, buffer);
-				serbufindex = 0;
-				break;
-			} // Note deliberate fallthrough
-			default: 
-			serbufindex++; break;
-	};
-	 
-	 if (serbufindex == staticInfo.responseLength + 8) {	// end of packet
-		 int checksum = 0;
-		 int i;
-		 for (i = 3; i < staticInfo.responseLength + 7; i++)
-			 checksum += serialbuf[i];
-		 if ((checksum & 0xFF) != serialbuf[serbufindex -1]) {
-			 sprintf(buffer, "WARN " PROGNAME " %d Checksum fails got %02x instead of %02x", controllernum, serialbuf[serbufindex -1], checksum);
-			 logmsg(WARN, buffer);
-			 serbufindex = 0;
-			 return;
-		 }
-		 staticInfo.commandComplete = 1; // signal we have a complete packet
-		 processPacket(serialbuf);
-		 serbufindex = 0;
-	 }
-	 DEBUG2 fprintf(stderr, "Leaving processComm\n");
-};
+	TP(TP_SOCKET, tpRemote, fd, nodelay, keepalive);
+	return fd;
+}
+
+/**************/
+/* MEASURERTT */
+/**************/
+void measureRtt(int sample) {
+	// Called once the reply to the outstanding command is known. Sample is mSec from sending it to
+	// the reply's first byte. Anything unsolicited ahead of the reply is not a sample.
+	// Smoothed as TCP does (RFC 6298): SRTT and RTTVAR.
+	float err;
+	if (!rttPending) return;
+	rttPending = 0;
+	if (sample < 0 || sample > 10000) return;		// clock stepped
+	if (latency[rttTarget].samples++ == 0) {
+		latency[rttTarget].srtt = sample;
+		latency[rttTarget].rttvar = sample / 2.0;
+	} else {
+		err = sample - latency[rttTarget].srtt;
+		latency[rttTarget].srtt += err / 8;
+		latency[rttTarget].rttvar += ((err < 0 ? -err : err) - latency[rttTarget].rttvar) / 4;
+	}
+	TP(TP_RX, tpRtt, rttTarget, sample, tpFloat(latency[rttTarget].srtt), tpFloat(latency[rttTarget].rttvar));
+}
+
+/************/
+/* CHARTIME */
+/************/
+float charTime(void) {
+	// 10 bits per character: start, 8 data, stop
+	switch(BAUD) {
+		case B2400: return 10000.0 / 2400;
+		case B4800: return 10000.0 / 4800;
+		case B9600: return 10000.0 / 9600;
+		default:	return 10000.0 / 19200;
+	}
+}
+
+/****************/
+/* FRAMETIMEOUT */
+/****************/
+int frameTimeout(void) {
+	// Silence that marks the end of a frame: a few character times on a local line. A remote link
+	// may split a frame across segments so also allow for the jitter seen on this device.
+	// Until the remote link has been measured keep the 1.33 value.
+	int t = MINFRAMETIMEOUT + 4 * charTime();
+	if (remote) {
+		if (latency[rttTarget].samples == 0) return FRAMETIMEOUT;
+		t += latency[rttTarget].srtt / 2 + 2 * latency[rttTarget].rttvar;
+	}
+	if (t > MAXFRAMETIMEOUT) t = MAXFRAMETIMEOUT;
+	return t;
+}
+
+/****************/
+/* REPLYTIMEOUT */
+/****************/
+int replyTimeout(void) {
+	// How long to wait for the first byte of a reply, plus time to clock in the longest frame.
+	int t;
+	if (latency[rttTarget].samples == 0) return INITREPLY;
+	t = latency[rttTarget].srtt + 4 * latency[rttTarget].rttvar + BUFSIZE * charTime() + frameTimeout();
+	if (t < MINREPLY) t = MINREPLY;
+	if (t > INITREPLY * 5) t = INITREPLY * 5;
+	return t;
+}
+
+/************/
+/* PACETIME */
+/************/
+int paceTime(int waittime) {
+	// Gap before the next command. -w n fixes it at n seconds as before; -w 0 paces by how fast
+	// the bus is actually answering, never more than the default WAITTIME.
+	int t;
+	if (waittime > 0) return waittime * 1000;
+	t = MINPACE + latency[rttTarget].srtt + 2 * latency[rttTarget].rttvar;
+	if (t > WAITTIME * 1000) t = WAITTIME * 1000;
+	return t;
+}
+
+/***********/
+/* MSSINCE */
+/***********/
+int msSince(struct timeval * tv) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000 + (now.tv_usec - tv->tv_usec) / 1000;
+}
+
 
 float tentothe(int n) {	// lookup function for 10^integer power within range -3 to +10
 static float a[14] = {0.001, 0.01, 0.1, 1.0, 10.0, 100.0, 1000.0, 10000.0, 100000.0, 1000000.0, 10000000.0, 100000000.0,
 1000000000.0, 10000000.00};
-	DEBUG if (n > 10) fprintf(DEBUGFP, "Exponent Overflow %d ", n);
-	DEBUG if (n < -3) fprintf(DEBUGFP, "Exponent Underflow %d ", n);
- 
-	if (n > 10 || n < -3) return 0;
+	if (n > 10 || n < -3) {
+		TP(TP_DECODE, tpExponent, n);
+		return 0;
+	}
 	return a[n+3];
 }
 
@@ -744,14 +1389,15 @@ void processPacket(unsigned char * msg) {
 	float value = 0.0;
 	static int have_warned = 0;		// For inverter 0 error
 	static int commserr = 0;
+	static int checksumerr = 0;
 	int i;
-	DEBUG2 fprintf(DEBUGFP, "Process packet length %d ", msg[3]);
+	TP(TP_DECODE, tpPacket, msg[3], msg[6], msg[4], msg[5]);
 
 	// Validate packet
 	if (data.count < msg[3] + 8) {
 		shortpacket ++;
-		DEBUG fprintf(stderr, "Dropping short (%d) packet\n", data.count);
-		if (!shortpacket % 100) {
+		TP(TP_DECODE, tpShort, data.count, msg[3] + 8);
+		if (shortpacket % 100 == 0) {		// 1.54 was !shortpacket % 100, which is never true
 			sprintf(buffer, "INFO " PROGNAME " %d %d short packets dropped", controllernum, shortpacket);
 			logmsg(INFO, buffer);
 		}
@@ -760,37 +1406,54 @@ void processPacket(unsigned char * msg) {
 	
 	for (i = 0; i < 3; i++) 
 	if (msg[i] != 0x80) {
+			TP(TP_DECODE, tpHeader, i, msg[i], commserr);
+			TPDATA(TP_DECODE, tpRxData, data.buf, data.count);
 			if (!commserr) {
 				sprintf(buffer, "WARN " PROGNAME " %d failed to read header byte %d as 0x80 - got 0x%02x", controllernum, 0, msg[i]);
 				logmsg(WARN, buffer);
 				commserr = 1;
-				DEBUG fprintf(stderr, "%s\nBad packet: ", buffer);
-				DEBUG dumpbuf();
 			}
 			commserr ++;
 			if (commserr % 100 == 0) {
 				sprintf(buffer, "WARN " PROGNAME " %d - %d non-header bytes", controllernum, commserr);
 				logmsg(WARN, buffer);
-				DEBUG fprintf(stderr, "%s\nBad packet: ", buffer);
-				DEBUG dumpbuf();
 			}
 		}
 		else {
 			if (commserr) {
 				sprintf(buffer, "INFO " PROGNAME " %d exiting comms error mode after %d non-header bytes", controllernum, commserr);
 				logmsg(INFO, buffer);
-				DEBUG fprintf(stderr, "%s\nBad packet: ", buffer);
-				DEBUG dumpbuf();
 				commserr = 0;
 			}
 		}
+	if (msg[0] != 0x80 || msg[1] != 0x80 || msg[2] != 0x80) return;	// 1.54 Not a frame at all
 	
 	int checksum = 0;
 	for (i = 3; i < len + 7; i++)
 		checksum += msg[i];
 	if ((checksum & 0xFF) != msg[len + 7]) {
-		sprintf(buffer, "WARN " PROGNAME " %d Checksum fails got %02x instead of %02x", controllernum, msg[len + 7], checksum);
-		logmsg(WARN, buffer);
+		TP(TP_DECODE, tpChecksum, msg[len + 7], checksum & 0xFF);
+		// 1.54 A storm of these was logging every one
+		if (checksumerr++ % 100 == 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d Checksum fails got %02x instead of %02x (%d so far)", 
+					controllernum, msg[len + 7], checksum & 0xFF, checksumerr);
+			logmsg(WARN, buffer);
+		}
+		return;
+	}
+	// 1.40 Error messages are unsolicited - they must not be taken as the reply to the current command
+	if (index == ERRORSTATE) {
+		processError(msg);
+		return;
+	}
+	// 1.54 Each reply has a minimum length. Shorter ones would decode the zeroes after them.
+	if (len < ((index >= VARSTART && index <= 0x2A) ? 3 : index == PROTOCOLERROR ? 2 :
+			   (index == GETDEVICETYPE || index == SETERRORFORWARDING) ? 1 : 0)) {
+		if (shortpacket++ % 100 == 0) {
+			sprintf(buffer, "INFO " PROGNAME " %d Reply to 0x%02x has %d data bytes - dropped (%d short so far)", 
+					controllernum, index, len, shortpacket);
+			logmsg(INFO, buffer);
+		}
 		return;
 	}
 	staticInfo.commandComplete = 1; // signal we have a complete packet
@@ -802,8 +1465,6 @@ void processPacket(unsigned char * msg) {
 	
 	if (index >= VARSTART && index <= VAREND) {	// If it's a value, check exponent.
 		value = val * tentothe(exp);		// value may be zero due to underflow/overflow of exponent
-		DEBUG2 fprintf(DEBUGFP, "%s Process message %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x (val %d) ", 
-			getTime(), msg[0], msg[1], msg[2], msg[3], msg[4], msg[5], msg[6], msg[7], msg[8], msg[9], msg[10], val);
 		if (exp < -3) {
 			sprintf(buffer, "WARN " PROGNAME " %d Exponent underflow: %02x in message %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x (val %d)", 
 					controllernum + currentInverter, exp, msg[0], msg[1], msg[2], msg[3], msg[4], msg[5], msg[6], msg[7], msg[8], msg[9], msg[10], val);
@@ -829,31 +1490,69 @@ void processPacket(unsigned char * msg) {
 		
 		// Bounds check on inverter[currentInverter];
 		int invnum = inverter[currentInverter];
+		if (staticInfo.currentSequence == Refresh || staticInfo.currentSequence == Aligned) invnum = staticInfo.target;
 		if (invnum < 1 || invnum > MAXINVERTERS) {
 			sprintf(buffer, "ERROR " PROGNAME " %d InverterNumber out of bounds: %d (Max is %d)", controllernum + invnum - 1, invnum, MAXINVERTERS);
 			logmsg(ERROR, buffer);
+			return;		// 1.54 went on to index responseVal with it
 		}
 		float *valp = responseVal[invnum - 1];
-		DEBUG2 fprintf(DEBUGFP, " responseVal[%d][%02d] to %f\n", currentInverter, index, value);
+		int accepted = 0;		// sanitycheck took the value
+		TP(TP_DECODE, tpValue, invnum, index, val, exp, tpFloat(value));
 		
 		// DANGER using index (validated above as in range VARSTART .. 0x2A into arrays declared as [VAREND - VARSTART + 1] which is 0..8
 		
-		if (index >= VARSTART && index <= VAREND)
-			valp[index - VARSTART] = sanitycheck(value, index, valp[index - VARSTART], &count[invnum - 1][index - VARSTART]);
-		else {
+		if (index >= VARSTART && index <= VAREND) {
+			float prev = valp[index - VARSTART];
+			if ((accepted = sanitycheck(value, index, invnum, exp))) {	// A rejected value is not a new reading
+				valp[index - VARSTART] = value;
+				sampleTime[invnum - 1][index - VARSTART] = rxTime ? rxTime : timeNow();	// 1.55 as it arrived
+				plantUpdate(invnum, index - VARSTART, prev, value);
+				energyUpdate(invnum, index - VARSTART, exp);
+				rollupUpdate(invnum, index - VARSTART);
+				shmPublish(invnum);
+				mcastPublish(invnum, index - VARSTART);		// 1.58 before anything else is done with it
+			}
+		} else {
 			sprintf(buffer, "WARN " PROGNAME " %d Ignoring invalid data index %d", controllernum + invnum - 1, index);
 			logmsg(WARN, buffer);
 		}
 		staticInfo.awaitReply = 0;  
+		if (staticInfo.currentSequence == Aligned) {	// 1.60 Note when it came, then the next reading
+			i = index - VARSTART;
+			if (accepted && align.step < align.steps && i == align.val[align.step / align.ninv]) {
+				double t = sampleTime[invnum - 1][i];
+				if (align.first[i] == 0 || t < align.first[i]) align.first[i] = t;
+				if (t > align.last[i]) align.last[i] = t;
+				if (i == 0x10 - VARSTART) align.watts += valp[i];
+				align.got++;
+			}
+			staticInfo.sequenceComplete = !alignStep();
+			return;
+		}
+		if (staticInfo.currentSequence == Refresh) {	// Next wanted value, or answer. Sweep order is untouched
+			do staticInfo.commandIndex++;
+			while (staticInfo.commandIndex <= VAREND && !(staticInfo.refreshMask & (1 << (staticInfo.commandIndex - VARSTART))));
+			if (staticInfo.commandIndex > VAREND) {
+				staticInfo.sequenceComplete = 1;
+				latestSend(staticInfo.replyFd, invnum, staticInfo.refreshMask);
+			}
+			return;
+		}
 		if (++staticInfo.commandIndex > staticInfo.commandLimit) {
 			// DEBUG fprintf(DEBUGFP, "Sequence Complete\n");
 			staticInfo.sequenceComplete = 1;		// send data.
+#ifdef TINY
+			fmtData(buffer, invnum);
+#else
 			if (dataFormat == old) 
 				sprintf(buffer, "data 9 %.0f %.0f %.0f %.0f %.2f %.1f %.2f %.3f %.1f", valp[0],
 				valp[1], valp[2], valp[3], valp[4], valp[5], valp[6], valp[7],valp[8]);
 			else
-				sprintf(buffer, "inverter watts:%.0f kwh:%.1f iac:%.2f vac:%.1f hz:%.3f idc:%.2f vdc:%.1f",
-						valp[0], valp[1]/1000.0, valp[4], valp[5], valp[6], valp[7], valp[8]);
+				sprintf(buffer, "inverter watts:%.0f kwh:%.1f iac:%.2f vac:%.1f hz:%.3f idc:%.2f vdc:%.1f wh:%.0f ts:%.3f",
+						valp[0], valp[1]/1000.0, valp[4], valp[5], valp[6], valp[7], valp[8], energy[invnum - 1].wh,
+						sampleTime[invnum - 1][0]);		// ts: when the power reading arrived
+#endif
 			// Bugfix -was looking at valp[3] - energy for year not energy for ever.
 
 // WARNING complex logic.  If not all inverters are online, we iterate through a subset.  For example a 
@@ -870,12 +1569,16 @@ void processPacket(unsigned char * msg) {
 				logmsg(ERROR, buffer);
 				return;
 			}
-			DEBUG fprintf(stderr, "SEND[%d]: %s\n", invnum, buffer);
-			sockSend(sockfd[invnum - 1], buffer);
+			TP(TP_SOCKET, tpSend, invnum, strlen(buffer));
+			sinkRecord(invnum, buffer);
 			// Progress to next inverter or reset to first
 			currentInverter++;
-			if (currentInverter >= numInverters) currentInverter = 0;
-			DEBUG2 fprintf(DEBUGFP, "Current inverter set to %d (%d) ", currentInverter, inverter[currentInverter]);
+			if (currentInverter >= numInverters) {
+				currentInverter = 0;
+				plantSend();
+				discoverDue = 1;
+			}
+			TP(TP_DECODE, tpNext, currentInverter, inverter[currentInverter]);
 		}
 	} else 
         switch (index) { // the response type
@@ -886,13 +1589,14 @@ void processPacket(unsigned char * msg) {
 							controllernum + currentInverter, msg[7] == 4 ? "IG+/RS485" : (msg[7] == 5 ? "IG TL/RS485" : "???"),
 							msg[8], msg[9], msg[10], msg[11], msg[12], msg[13], msg[14]);
 					logmsg(INFO, buffer);
+					scriptResult(buffer);
+					infoVersion(msg[5], msg + 7);
 					break;
 				}
 				if (len == 4) {	// Broadcast version
 					systemType = msg[7];
-					if (systemType < lastType) {
-						DEBUG fprintf(stderr, "Setting system type '%s' (%d)\n", systemStr[systemType], systemType);
-					}
+					if (systemType < lastType)
+						TP(TP_DECODE, tpSystem, systemType);
 					else {
 						sprintf(buffer, "ERROR " PROGNAME " %d GetVersion got invalid system type as %d", 
 								controllernum + currentInverter, systemType);
@@ -902,23 +1606,24 @@ void processPacket(unsigned char * msg) {
 					sprintf(buffer ,"INFO " PROGNAME " %d Type %s Version %02x.%02x.%02x", controllernum + currentInverter, 
 							systemStr[systemType], msg[8], msg[9], msg[10]);
 					logmsg(INFO, buffer);
+					scriptResult(buffer);
 				}
                 break;
 			case GETDEVICETYPE:                      // Device type
 		        staticInfo.sequenceComplete = 1;
 				sprintf(buffer, "INFO " PROGNAME " %d Device Type %02x (%s)", controllernum + currentInverter, msg[7], deviceType(msg[7]));
 				logmsg(INFO, buffer);
+				scriptResult(buffer);
+				infoType(msg[5], msg[7]);		// Sets the limits in sanitycheck
                 break;
 			case GETACTIVEINVERTERS:                      // Active inverters
 				staticInfo.sequenceComplete = 1;
-				DEBUG2 fprintf(DEBUGFP, "Activeinverters: inverterStatus %x prevInverterStatus %x\n", inverterStatus, prevInverterStatus);
 				if (msg[3] == 0) {
 					inverterStatus = 0;
 					numInverters = 0;
-					if (inverterStatus != prevInverterStatus) {
-						sprintf(buffer, "WARN " PROGNAME " %d No active inverters", controllernum);
+					sprintf(buffer, "WARN " PROGNAME " %d No active inverters", controllernum);
+					if (inverterStatus != prevInverterStatus)
 						logmsg(WARN, buffer);
-					}
 				} else {
 					if (msg[3] <= MAXINVERTERS) {
 						int i; char buf2[10];
@@ -946,17 +1651,22 @@ void processPacket(unsigned char * msg) {
 								return;
 							}
 							strcat(buffer, buf2);
-							if (inverter[i] < 32) inverterStatus |= (1 << inverter[i]); // Watch out for overflow of int
+							if (inverter[i] < 32) inverterStatus |= (1U << inverter[i]); // Watch out for overflow of int
 						}
 						if (inverterStatus != prevInverterStatus) // Require that at least one inverter is numbered less than 32!
 							logmsg(INFO, buffer);
-						DEBUG fprintf(DEBUGFP, "InverterStatus bitmask = %04x ", inverterStatus);
 					}
 					else {
 						sprintf(buffer, "WARN " PROGNAME " %d Got invalid length for Active Inverters as %d", controllernum, msg[3]);
 						logmsg(WARN, buffer);
 					}
 				}
+				scriptResult(buffer);
+				TP(TP_DECODE, tpActive, inverterStatus, prevInverterStatus);
+				if (inverterStatus != prevInverterStatus) {
+					plantRecompute();
+					shmPublish(0);
+				}
 				prevInverterStatus = inverterStatus;
 					break;
 			case SETERRORFORWARDING:		// Activate Error response.
@@ -966,30 +1676,32 @@ void processPacket(unsigned char * msg) {
 			// The errorActivateState variable tracks progress through initialisation and then gets out of the
 			// way in case we are issuing ErrorActivate commands interactively.
 				staticInfo.sequenceComplete = 1;
-				DEBUG fprintf(DEBUGFP, "ActivateError response to %d: 0x%02x eas=%d ", errorParam1, msg[7], errorActivateState);
+				TP(TP_DECODE, tpActivated, errorParam1, msg[7], errorActivateState);
 				if (errorActivateState == easInit) {	// Response to initial ErrorActivate
 					if (msg[7] == 0x55) {	// success
 						errorActivateState = easComplete;
 						sprintf(buffer, "INFO " PROGNAME " %d ActivateError successful on %d\n", controllernum, errorParam1);
 						logmsg(INFO, buffer);
+						scriptResult(buffer);
 						break;
 					} else {	// failed. Give up.
 						errorActivateState = easComplete;
 						sprintf(buffer, "WARN " PROGNAME " %d Activate Error Forwarding failed", controllernum);
 						logmsg(WARN, buffer);
+						scriptResult(buffer);
 						break;
 					}
 				}		
 				if (errorActivateState == easComplete) { // Response to interactive Error Activation
 					if (msg[7] == 0x55) {	// success
-						DEBUG fprintf(DEBUGFP, "ActivateError (interactive) successful\n");
 						sprintf(buffer, "INFO " PROGNAME " %d Activate Error Forwarding succeeded", controllernum);
 						logmsg(INFO, buffer);
+						scriptResult(buffer);
 						break;
 					} else {	// failed.  This is a problem
-						DEBUG fprintf(DEBUGFP, "ActivateError (interactive) failed\n");
 						sprintf(buffer, "WARN " PROGNAME " %d Activate Error Forwarding failed", controllernum);
 						logmsg(WARN, buffer);
+						scriptResult(buffer);
 						break;
 					}
 				}
@@ -1035,6 +1747,7 @@ void processPacket(unsigned char * msg) {
 				// Format of string is 1 2 ff ff where ff is success and 1, 2 are failure. 
 				// Could be improved.
 				logmsg(INFO, buffer);
+				scriptResult(buffer);
 				errorActivateState = easComplete;
 				break;				
 			case PROTOCOLERROR:		// Error response as inverter is off (night time)
@@ -1042,15 +1755,12 @@ void processPacket(unsigned char * msg) {
 				sprintf(buffer, "INFO " PROGNAME " %d Protocol Error: Command 0x%02x %s - ignoring\n", 
 						controllernum + currentInverter, msg[7], protocolError(msg[8]));
 				logmsg(INFO, buffer);
+				scriptResult(buffer);
+				if (staticInfo.currentSequence == Refresh)		// Inverter asleep: cached values will have to do
+					latestSend(staticInfo.replyFd, staticInfo.target, staticInfo.refreshMask);
 				// TODO put code in here to handle a error response to 0D ActivateError command
-				staticInfo.sequenceComplete = 1;
+				staticInfo.sequenceComplete = staticInfo.currentSequence == Aligned ? !alignStep() : 1;
 				break;	
-			case ERRORSTATE:		// Error Message
-			// TODO code to suppress extraneous messages
-				sprintf(buffer, "WARN " PROGNAME " %d ErrorCode Dev/Opt:%d Number:%d Code:%d Extra:%d %s", 
-						controllernum, msg[4], msg[5], val, msg[9], statusText(msg[9]));
-				logmsg(WARN, buffer);
-				break;
 			default:                // unexpected response
                 sprintf(buffer, "WARN " PROGNAME " %d Unexpected packet LEN %02x DEV %02x NUM %02x CMD %02x %02x %02x", 
 					controllernum + currentInverter, msg[3], msg[4], msg[5], msg[6], msg[7], msg[8]);
@@ -1059,38 +1769,243 @@ void processPacket(unsigned char * msg) {
         }
 };
 
+/****************/
+/* PROCESSERROR */
+/****************/
+void processError(unsigned char * msg) {
+	// ERRORSTATE: Number is the inverter, data is a 2 byte error code and an extra byte.
+	// 1.40 - A code already active on that inverter within FAULTWINDOW is counted but not reported again.
+	// Previously statusText() was given the extra byte so never found a message.
+	char buffer[200];
+	int invnum = msg[5];
+	int code = msg[8] + msg[7] * 256;
+	int extra = msg[9];
+	time_t now = time(NULL);
+	struct fault * fp, * freep = NULL;
+	int i;
+	
+	if (msg[3] < 3) {
+		sprintf(buffer, "WARN " PROGNAME " %d ErrorCode with short data (%d) from Dev/Opt:%d Number:%d", 
+				controllernum, msg[3], msg[4], invnum);
+		logmsg(WARN, buffer);
+		return;
+	}
+	if (invnum < 1 || invnum > MAXINVERTERS) {
+		sprintf(buffer, "WARN " PROGNAME " %d ErrorCode Dev/Opt:%d Number:%d Code:%d Extra:%d %s", 
+				controllernum, msg[4], invnum, code, extra, statusText(code));
+		logmsg(WARN, buffer);
+		return;
+	}
+	for (i = 0, fp = activeFault[invnum - 1]; i < MAXFAULTS; i++, fp++) {
+		if (fp->code == code) break;
+		if (fp->code == 0 && freep == NULL) freep = fp;
+	}
+	if (i < MAXFAULTS) {		// Already active
+		fp->count++;
+		fp->extra = extra;
+		if (now - fp->last < FAULTWINDOW) {
+			fp->last = now;
+			TP(TP_DECODE, tpRepeat, invnum, code, fp->count);
+			shmPublish(invnum);
+			return;
+		}
+		fp->last = now;
+		faultEvent(invnum, fp, "repeat");
+		shmPublish(invnum);
+		return;
+	}
+	if (freep == NULL) {	// Table full: retire the stalest entry
+		freep = activeFault[invnum - 1];
+		for (i = 1, fp = activeFault[invnum - 1] + 1; i < MAXFAULTS; i++, fp++)
+			if (fp->last < freep->last) freep = fp;
+		faultRetire(invnum, freep);
+	}
+	freep->code = code;
+	freep->class = code / 100 * 100;
+	freep->extra = extra;
+	freep->first = freep->last = now;
+	freep->count = 1;
+	sprintf(buffer, "WARN " PROGNAME " %d ErrorCode Dev/Opt:%d Number:%d Code:%d Extra:%d %s", 
+			controllernum + invnum - 1, msg[4], invnum, code, extra, statusText(code));
+	logmsg(WARN, buffer);
+	faultEvent(invnum, freep, "active");
+	shmPublish(invnum);
+}
+
+/****************/
+/* EXPIREFAULTS */
+/****************/
+void expireFaults(void) {
+	// Faults are only ever reported, never cleared, by the inverter. Treat one as gone
+	// when it has not been repeated for FAULTCLEAR seconds.
+	time_t now = time(NULL);
+	int inv, i;
+	struct fault * fp;
+	for (inv = 0; inv < MAXINVERTERS; inv++)
+		for (i = 0, fp = activeFault[inv]; i < MAXFAULTS; i++, fp++)
+			if (fp->code && now - fp->last >= FAULTCLEAR) {
+				faultEvent(inv + 1, fp, "cleared");
+				faultRetire(inv + 1, fp);
+				shmPublish(inv + 1);
+			}
+}
+
+/***************/
+/* FAULTRETIRE */
+/***************/
+void faultRetire(int invnum, struct fault * fp) {
+	// Copy into the history ring and free the active slot.
+	struct faultRing * hp = &faultHistory[invnum - 1];
+	hp->entry[hp->next] = *fp;
+	if (++hp->next == FAULTHISTORY) hp->next = 0;
+	if (hp->used < FAULTHISTORY) hp->used++;
+	fp->code = 0;
+}
+
+/***************/
+/* FAULTREPORT */
+/***************/
+void faultReport(int fd, char * cmd) {
+	// GetFaults [inv] - active faults; GetFaultHistory [inv] - finished faults, newest first.
+	// One record per fault, then a summary line so the caller knows when it has them all.
+	char buffer[200];
+	int history = isCommand(cmd, "GetFaultHistory");
+	int from = 1, to = MAXINVERTERS, inv, i, n = 0;
+	struct fault * fp;
+	char * arg = cmd + (history ? 15 : 9);		// The space or NUL just after the word
+	
+	if (sscanf(arg, "%d", &inv) == 1) {
+		if (inv < 1 || inv > MAXINVERTERS) {
+			sprintf(buffer, "WARN " PROGNAME " %d %s: no inverter %d", controllernum, history ? "GetFaultHistory" : "GetFaults", inv);
+			logmsg(WARN, buffer);
+			return;
+		}
+		from = to = inv;
+	}
+	for (inv = from; inv <= to; inv++)
+		for (i = 0; i < (history ? faultHistory[inv - 1].used : MAXFAULTS); i++) {
+			if (history)	// walk back from the newest
+				fp = &faultHistory[inv - 1].entry[(faultHistory[inv - 1].next - 1 - i + FAULTHISTORY) % FAULTHISTORY];
+			else
+				fp = &activeFault[inv - 1][i];
+			if (fp->code == 0) continue;
+			sprintf(buffer, "%s inv:%d code:%d class:%d extra:%d first:%ld last:%ld count:%d text:%s", 
+					history ? "faulthistory" : "faults", inv, fp->code, fp->class, fp->extra,
+					(long)fp->first, (long)fp->last, fp->count, statusText(fp->code));
+			sockSend(fd, buffer);
+			n++;
+		}
+	sprintf(buffer, "%s end count:%d", history ? "faulthistory" : "faults", n);
+	sockSend(fd, buffer);
+}
+
+/**************/
+/* FAULTEVENT */
+/**************/
+void faultEvent(int invnum, struct fault * fp, char * what) {
+	// Structured fault record on the inverter's own connection, or the first if it has none.
+	char buffer[200];
+	int fd = invSock(invnum);
+	if (noserver) return;
+	sprintf(buffer, "fault %s inv:%d code:%d class:%d extra:%d count:%d age:%ld text:%s", what, invnum,
+			fp->code, fp->class, fp->extra, fp->count, (long)(fp->last - fp->first), statusText(fp->code));
+	TP(TP_SOCKET, tpSend, invnum, strlen(buffer));
+	sockSend(fd, buffer);
+}
+
 /*****************/
 /* PROCESSSOCKET */
 /*****************/
-int processSocket(void) {
+int processSocket(int n) {
 	// Deal with commands from MCP.  Return to 0 to do a shutdown
 	// Commands get added to the queue
-	short int msglen, numread;
-	char buffer[128];  // about 128 is good but rather excessive since longest message is 'truncate'
-	char * cp = &buffer[0];
-	int retries = NUMRETRIES;
+	// 1.49 - Any connection, not just the first. Called when select says the socket is readable, so
+	// one read() never blocks. Messages (2 byte length + text) are built up across calls, and a
+	// slow server no longer costs a 1 second sleep per fragment.
+	struct sockreader * rp = &reader[n];
 	int num;
+	char buffer[200];
 	
-	if ((num = read(sockfd[0], &msglen, 2)) != 2) {
-		sprintf(buffer, "WARN " PROGNAME " %d ProcessSocket Failed to read length from socket", controllernum);
+	if (rp->have < 2)
+		num = read(sockfd[n], rp->len + rp->have, 2 - rp->have);
+	else if (rp->have - 2 < rp->msglen && rp->msglen <= SOCKMSG)
+		num = read(sockfd[n], rp->buf + rp->have - 2, rp->msglen - (rp->have - 2));
+	else {		// Too long: read and discard the body
+		char discard[64];
+		num = rp->msglen - (rp->have - 2);
+		num = read(sockfd[n], discard, num > sizeof(discard) ? sizeof(discard) : num);
+	}
+	if (num <= 0) {
+		if (num < 0 && (errno == EINTR || errno == EAGAIN)) return 1;
+		sprintf(buffer, "WARN " PROGNAME " %d ProcessSocket: server connection %d (fd %d) %s", controllernum, n, sockfd[n],
+				num == 0 ? "closed" : strerror(errno));
 		logmsg(WARN, buffer);
-		fprintf(DEBUGFP, "ProcessSocket - read %d sockfd = %d", num, sockfd[0]);
-		return 1;
+		return sockReopen(n);		// Else select() reports it readable forever
 	}
-	msglen =  ntohs(msglen);
-	while ((numread = read(sockfd[0], cp, msglen)) < msglen) {
-		cp += numread;
-		msglen -= numread;
-		DEBUG printf("Only read %d, %d remaining\n", numread, msglen);
-		if (--retries == 0) {
-			sprintf(buffer, "WARN " PROGNAME " %d Timed out reading from server", controllernum);
+	rp->have += num;
+	if (rp->have < 2) return 1;
+	if (rp->have == 2) {
+		rp->msglen = rp->len[0] * 256 + rp->len[1];		// network order
+		if (rp->msglen > SOCKMSG) {
+			sprintf(buffer, "WARN " PROGNAME " %d ProcessSocket: discarding %d byte message (max %d)", controllernum, rp->msglen, SOCKMSG);
 			logmsg(WARN, buffer);
-			return 1;
 		}
-		usleep(RETRYDELAY);
 	}
-	cp[numread] = '\0';     // terminate the buffer 
-	DEBUG fprintf(DEBUGFP,"ProcessSocket: '%s'\n", buffer);
+	if (rp->have - 2 < rp->msglen) return 1;	// more to come
+	rp->have = 0;
+	if (rp->msglen > SOCKMSG) return 1;
+	rp->buf[rp->msglen] = '\0';     // terminate the buffer 
+	return processCommand(sockfd[n], rp->buf);
+}
+
+/************/
+/* SOCKOPEN */
+/************/
+void sockOpen(int start, int num) {
+	// Connect to servers start .. start + num - 1 and log on as the data format says
+	if (dataFormat == old)
+		openSockets(start, num, LOGON, REVISION, "", 0);
+	else
+		openSockets(start, num, "inverter", REVISION, PROGNAME, 0);
+}
+
+/**************/
+/* SOCKREOPEN */
+/**************/
+int sockReopen(int n) {
+	// The server closed connection n. Connect again, with nothing left of a message half read.
+	// Return 1 if connected, 0 to shut down and be restarted.
+	char buffer[200];
+	close(sockfd[n]);
+	sockfd[n] = -1;
+	bzero(&reader[n], sizeof(reader[n]));
+	sockOpen(n, 1);
+	if (sockfd[n] < 0) {
+		sprintf(buffer, "ERROR " PROGNAME " %d ProcessSocket: can't reconnect server connection %d", controllernum, n);
+		logmsg(ERROR, buffer);
+		return 0;
+	}
+	sprintf(buffer, "INFO " PROGNAME " %d ProcessSocket: server connection %d reconnected (fd %d)", controllernum, n, sockfd[n]);
+	logmsg(INFO, buffer);
+	return 1;
+}
+
+/*************/
+/* ISCOMMAND */
+/*************/
+int isCommand(char * buffer, char * word) {
+	// The whole word, then a space or the end: GetFault and GetFaultsX are not GetFaults
+	int len = strlen(word);
+	return strncasecmp(buffer, word, len) == 0 && (buffer[len] == ' ' || buffer[len] == '\0');
+}
+
+/******************/
+/* PROCESSCOMMAND */
+/******************/
+int processCommand(int fd, char * buffer) {
+	// One complete message from a server. Buffer is writable and SOCKMSG + 1 long.
+	// Replies to queries go back on fd.
+	TPDATA(TP_SOCKET, tpText, (unsigned char *)buffer, strlen(buffer));
 	
 	if (strcasecmp(buffer, "exit") == 0)                                    /* exit */
 		return 0;       // Terminate program
@@ -1107,167 +2022,463 @@ int processSocket(void) {
 
 		return 1;
 	}
-	else if (strcasecmp(buffer, "debug 0") == 0) {
-		debug = 0; return 1;
-	} else if (strcasecmp(buffer, "debug 1") ==0) {
-		debug = 1; return 1;
-	} else if (strcasecmp(buffer, "debug 2") ==0) {
-		debug = 2; return 1;
-	} else if (strcasecmp(buffer, "help") == 0) {
-		logmsg(INFO, "INFO " PROGNAME " Available commands: GetSWVersion, GetDevType, GetActiveInverters, ActivateError xx yy, debug 0|1|2, exit");
+#ifndef TINY
+	else if (strncasecmp(buffer, "Tracepoints", 11) == 0) {		/* Tracepoints - 1.62 was debug 0|1|2 */
+		tpReport(fd, buffer);
 		return 1;
 	}
-	
-	// If it's a command, set SequenceComplete
-	staticInfo.sequenceComplete = 1;
-	// Check room avail in queue
-	queue.top++;
-	if (queue.top == QUEUESIZE) queue.top = 0;
-	if (queue.top == queue.bottom) {
-		sprintf(buffer, "WARN " PROGNAME " %d Queue full - ignoring command", controllernum);
-		logmsg(WARN, buffer);
-
+#endif
+	else if (strcasecmp(buffer, "help") == 0) {
+		logmsg(INFO, "INFO " PROGNAME " Available commands: GetSWVersion [n|*], GetDevType [n|*], GetActiveInverters, ActivateError xx yy, "
+			   "Batch [#tag] command; command; ..., GetLatest [n], Refresh n [watts|wh|..|vdc ..], GetInfo [n], GetFaults [n], GetFaultHistory [n], GetRollup [n] 1m|15m|day [current], GetSinks, GetTrace [n|file], Tracepoints [tx,rx,decode,sanity,socket|all|off|dump], exit");
 		return 1;
-	}
-	if (strcasecmp(buffer, "GetSWVersion") == 0) {                 /* GetSWVersion */
-		queue.type[queue.top] = GetVersion;
+	} else if (strncasecmp(buffer, "GetRollup", 9) == 0) {		/* GetRollup */
+		rollupReport(fd, buffer);
 		return 1;
-	}
-	if (strcasecmp(buffer, "GetDevType") == 0) {                  /* GetDeviceType */
-		queue.type[queue.top] = GetDevType;
+	} else if (isCommand(buffer, "GetFaults") || isCommand(buffer, "GetFaultHistory")) {		/* GetFaults GetFaultHistory */
+		faultReport(fd, buffer);
 		return 1;
-	}
-	if (strcasecmp(buffer, "GetActiveInverters") == 0) {                /* GetActiveInverters */
-		queue.type[queue.top] = GetActiveInverters;
+	} else if (strncasecmp(buffer, "GetLatest", 9) == 0) {		/* GetLatest */
+		latestReport(fd, buffer);
 		return 1;
-	}
-	if (strncasecmp(buffer, "ActivateError", 13) == 0) {		/* ActivateError */
-		int num = sscanf(buffer+13, "%d %x", &errorParam1, &errorParam2);
-		if (num == 0) {
-			sprintf(buffer, "INFO " PROGNAME " %d No parameters supplied to ActivateError", controllernum);
-			logmsg(INFO, buffer);
-	//	Must still invoke an Activate Error as otherwise there will be a hole in the queue
-		errorParam1 = 2;		// let's hope.
-		}
-		if (num == 1) errorParam2 = 0x55;
-		DEBUG fprintf(DEBUGFP, "ActivateError with num %d params %d (%02x) %d (%02x)\n", 
-			num, errorParam1, errorParam1, errorParam2, errorParam2);
-		queue.type[queue.top] = ActivateError;
+	} else if (strncasecmp(buffer, "Refresh", 7) == 0) {		/* Refresh */
+		refreshQueue(fd, buffer);
+		return 1;
+	} else if (strncasecmp(buffer, "GetInfo", 7) == 0) {		/* GetInfo */
+		infoReport(fd, buffer);
+		return 1;
+	} else if (strcasecmp(buffer, "GetSinks") == 0) {		/* GetSinks */
+		sinkReport(fd);
+		return 1;
+	} else if (strncasecmp(buffer, "GetTrace", 8) == 0) {		/* GetTrace */
+		traceReport(fd, buffer);
+		return 1;
+	} else if (strncasecmp(buffer, "Batch", 5) == 0) {		/* Batch */
+		if (scriptStart(fd, buffer + 5))
+			staticInfo.sequenceComplete = 1;
 		return 1;
 	}
 	
-	{ 
-		char buffer2[192];
-		sprintf(buffer2, "WARN " PROGNAME " %d Unknown message from server: ", controllernum);
-		strcat(buffer2, buffer);
-		logmsg(WARN, buffer2);  // Risk of loop: sending unknown message straight back to server
-		// Undo increment of queue.top;
-		queue.top--;
-		if (queue.top <0) queue.top = 0;
+	switch (queueOp(buffer, 0)) {
+		case -1: { 
+			char buffer2[SOCKMSG + 64];
+			sprintf(buffer2, "WARN " PROGNAME " %d Unknown message from server: ", controllernum);
+			strcat(buffer2, buffer);
+			logmsg(WARN, buffer2);  // Risk of loop: sending unknown message straight back to server
+			}
+			break;
+		case 0:		// Already logged
+			break;
+		default:
+			// If it's a command, set SequenceComplete
+			staticInfo.sequenceComplete = 1;
 	}
 	return 1;
 };
 
-char * deviceType(int n) {
+/************/
+/* QUEUEONE */
+/************/
+int queueOne(enum CommandType type, int target, int arg1, int arg2, int scripted) {
+	// Add a command to the queue. Return 1 if there was room
+	int top = queue.top + 1;
+	if (top == QUEUESIZE) top = 0;
+	if (top == queue.bottom) {
+		sprintf(buffer, "WARN " PROGNAME " %d Queue full - ignoring command", controllernum);
+		logmsg(WARN, buffer);
+		return 0;
+	}
+	queue.type[top] = type;
+	queue.param[top] = target;
+	queue.arg1[top] = arg1;
+	queue.arg2[top] = arg2;
+	queue.op[top] = scripted ? ++script.ops : 0;
+	queue.fd[top] = -1;
+	queue.top = top;
+	return 1;
+}
+
+/***********/
+/* QUEUEOP */
+/***********/
+int queueOp(char * op, int scripted) {
+	// GetSWVersion [n|*], GetDevType [n|*], GetActiveInverters or ActivateError [xx [yy]].
+	// n picks the inverter, * is every active one. Return the number queued; 0 if that failed
+	// (logged), -1 if it is not one of these.
+	char name[32], arg[32];
+	int num, i, target, p1 = 2, p2 = 0x55;
+	enum CommandType type;
+	
+	num = sscanf(op, "%31s %31s %x", name, arg, &p2);
+	if (num < 1) return -1;
+	if (strcasecmp(name, "GetSWVersion") == 0) type = GetVersion;
+	else if (strcasecmp(name, "GetDevType") == 0) type = GetDevType;
+	else if (strcasecmp(name, "GetActiveInverters") == 0) type = GetActiveInverters;
+	else if (strcasecmp(name, "ActivateError") == 0) type = ActivateError;
+	else return -1;
+	
+	if (type == ActivateError) {
+		if (num == 1) {
+			sprintf(buffer, "INFO " PROGNAME " %d No parameters supplied to ActivateError", controllernum);
+			logmsg(INFO, buffer);
+			// p1 = 2: let's hope.
+		} else
+			p1 = atoi(arg);
+		if (num == 2) p2 = 0x55;
+		TP(TP_SOCKET, tpActivate, p1, p1, p2, p2);
+		return queueOne(ActivateError, 0, p1, p2, scripted);
+	}
+	if (num == 1 || type == GetActiveInverters)
+		return queueOne(type, 0, 0, 0, scripted);
+	if (strcmp(arg, "*") == 0) {
+		if (numInverters == 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d %s *: no active inverters", controllernum, name);
+			logmsg(WARN, buffer);
+			return 0;
+		}
+		for (i = 0; i < numInverters; i++)
+			if (!queueOne(type, inverter[i], 0, 0, scripted)) return 0;
+		return numInverters;
+	}
+	target = atoi(arg);
+	if (target < 1 || target > MAXINVERTERS) {
+		sprintf(buffer, "WARN " PROGNAME " %d %s: invalid inverter '%s'", controllernum, name, arg);
+		logmsg(WARN, buffer);
+		return 0;
+	}
+	return queueOne(type, target, 0, 0, scripted);
+}
+
+/***************/
+/* SCRIPTSTART */
+/***************/
+int scriptStart(int fd, char * cmd) {
+	// Batch [#tag] op; op; ...   Each op is as queueOp() takes. They are queued together and
+	// sent back-to-back, and one message goes back on fd when the last has been answered:
+	// "batch <id> [#tag] ops:<n>" then a line per op "<op> <command> inv:<n> <result>".
+	// Return 1 if queued. Only one Batch at a time.
+	char * op, * save;
+	int top = queue.top;
+	
+	while (*cmd == ' ') cmd++;
+	if (script.id) {
+		sprintf(buffer, "WARN " PROGNAME " %d Batch %d still running - ignoring Batch", controllernum, script.id);
+		logmsg(WARN, buffer);
+		return 0;
+	}
+	script.tag[0] = '\0';
+	if (*cmd == '#') {
+		sscanf(cmd, "%31s", script.tag);
+		cmd += strcspn(cmd, " ;");
+	}
+	script.ops = script.done = 0;
+	for (op = strtok_r(cmd, ";", &save); op; op = strtok_r(NULL, ";", &save)) {
+		while (*op == ' ') op++;
+		if (*op == '\0') continue;
+		if (queueOp(op, 1) <= 0) {		// All or nothing
+			sprintf(buffer, "WARN " PROGNAME " %d Batch rejected at '%s'", controllernum, op);
+			logmsg(WARN, buffer);
+			queue.top = top;
+			return 0;
+		}
+	}
+	if (script.ops == 0) {
+		sprintf(buffer, "WARN " PROGNAME " %d Batch: nothing to do", controllernum);
+		logmsg(WARN, buffer);
+		return 0;
+	}
+	script.id = ++scriptSeq;
+	script.fd = fd;
+	script.len = sprintf(script.result, "batch %d%s%s ops:%d", script.id, script.tag[0] ? " " : "", script.tag, script.ops);
+	TP(TP_SOCKET, tpBatch, script.id, 0, script.ops);
+	return 1;
+}
+
+/****************/
+/* SCRIPTRESULT */
+/****************/
+void scriptResult(char * text) {
+	// The command sent for Batch operation staticInfo.scriptOp has been answered (or not).
+	// Called from every reply handler; does nothing outside a Batch.
+	int i, n;
+	if (staticInfo.scriptOp == 0 || script.id == 0) return;
+	i = queue.bottom;		// still the entry it came from
+	n = strcspn(text, "\n");
+	if (script.len + n + 64 < sizeof(script.result))
+		script.len += sprintf(script.result + script.len, "\n%d %s inv:%d %.*s", staticInfo.scriptOp,
+							  CommandName[queue.type[i]], queue.param[i], n, text);
+	staticInfo.scriptOp = 0;
+	TP(TP_SOCKET, tpBatch, script.id, script.done + 1, script.ops);
+	if (++script.done < script.ops) return;
+	sockSend(script.fd, script.result);
+	script.id = 0;
+}
+
+/**************/
+/* LATESTSEND */
+/**************/
+void latestSend(int fd, int inv, int mask) {
+	// latest inv:n watts:value/age ... for the values in mask. Age is seconds since it was read; - if never.
+	char buffer[512], buf2[64];
+	double now = timeNow();
+	int i;
+	
+	sprintf(buffer, "latest inv:%d", inv);
+	for (i = 0; i < VAREND - VARSTART + 1; i++) {
+		if (!(mask & (1 << i))) continue;
+		if (sampleTime[inv - 1][i] > 0)
+			sprintf(buf2, " %s:%.3f/%.1f", valueName[i], responseVal[inv - 1][i], now - sampleTime[inv - 1][i]);
+		else
+			sprintf(buf2, " %s:-", valueName[i]);
+		strcat(buffer, buf2);
+	}
+	TP(TP_SOCKET, tpSend, inv, strlen(buffer));
+	sockSend(fd, buffer);
+}
+
+/****************/
+/* LATESTREPORT */
+/****************/
+void latestReport(int fd, char * cmd) {
+	// GetLatest [n] - straight from responseVal, no bus traffic. One line per active inverter.
+	int from = 1, to = MAXINVERTERS, inv;
+	
+	if (sscanf(cmd + 9, "%d", &inv) == 1) {
+		if (inv < 1 || inv > MAXINVERTERS) {
+			sprintf(buffer, "WARN " PROGNAME " %d GetLatest: expected [1-%d]", controllernum, MAXINVERTERS);
+			logmsg(WARN, buffer);
+			return;
+		}
+		from = to = inv;
+	}
+	for (inv = from; inv <= to; inv++) {
+		if (from != to && (inv >= 32 || !(inverterStatus & (1 << inv)))) continue;
+		latestSend(fd, inv, (1 << (VAREND - VARSTART + 1)) - 1);
+	}
+}
+
+/****************/
+/* REFRESHQUEUE */
+/****************/
+void refreshQueue(int fd, char * cmd) {
+	// Refresh n [watts wh whday whyear iac vac hz idc vdc] - read them ahead of the sweep and
+	// answer as GetLatest. Default is all nine.
+	char name[16];
+	int inv, i, n, mask = 0;
+	
+	cmd += 7;
+	if (sscanf(cmd, "%d%n", &inv, &n) != 1 || inv < 1 || inv > MAXINVERTERS) {
+		sprintf(buffer, "WARN " PROGNAME " %d Refresh: expected 1-%d [values]", controllernum, MAXINVERTERS);
+		logmsg(WARN, buffer);
+		return;
+	}
+	for (cmd += n; sscanf(cmd, "%15s%n", name, &n) == 1; cmd += n) {
+		for (i = 0; i < VAREND - VARSTART + 1; i++)
+			if (strcasecmp(name, valueName[i]) == 0) break;
+		if (i == VAREND - VARSTART + 1) {
+			sprintf(buffer, "WARN " PROGNAME " %d Refresh: unknown value '%s'", controllernum, name);
+			logmsg(WARN, buffer);
+			return;
+		}
+		mask |= 1 << i;
+	}
+	if (mask == 0) mask = (1 << (VAREND - VARSTART + 1)) - 1;
+	if (!queueOne(Refresh, inv, mask, 0, 0)) return;
+	queue.fd[queue.top] = fd;
+	staticInfo.sequenceComplete = 1;	// Straight after the command in progress
+}
+
+/************/
+/* INFOLOAD */
+/************/
+void infoLoad(void) {
+	// One line per inverter, as infoSave writes. A missing file just means nothing is known yet.
+	char name[64], line[200];
+	FILE * fp;
+	int inv, type, known, v[8], i;
+	long when;
+	
+	sprintf(name, INFOFILE, controllernum);
+	if ((fp = fopen(name, "r")) == NULL) return;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "inv:%d type:%x version:%x.%x.%x.%x.%x.%x.%x.%x known:%d when:%ld", &inv, &type,
+				   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &known, &when) == 12
+			&& inv >= 1 && inv <= MAXINVERTERS) {
+			devType[inv - 1] = (known & DISC_TYPE) ? type : 0;
+			for (i = 0; i < 8; i++) invInfo[inv - 1].version[i] = v[i];
+			invInfo[inv - 1].known = known & DISC_ALL;
+			invInfo[inv - 1].when = when;
+			shmPublish(inv);
+		}
+	fclose(fp);
+}
+
+/************/
+/* INFOSAVE */
+/************/
+void infoSave(void) {
+	// Rewrite the whole file; it is tiny and rarely changes.
+	char name[64];
+	FILE * fp;
+	int i;
+	unsigned char * v;
+	
+	sprintf(name, INFOFILE, controllernum);
+	if ((fp = fopen(name, "w")) == NULL) {
+		sprintf(buffer, "WARN " PROGNAME " %d Can't write %s: %s", controllernum, name, strerror(errno));
+		logmsg(WARN, buffer);
+		return;
+	}
+	for (i = 0; i < MAXINVERTERS; i++) {
+		if (!invInfo[i].known) continue;
+		v = invInfo[i].version;
+		fprintf(fp, "inv:%d type:%02x version:%02x.%02x.%02x.%02x.%02x.%02x.%02x.%02x known:%d when:%ld\n", i + 1, devType[i],
+				v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], invInfo[i].known, (long)invInfo[i].when);
+	}
+	fclose(fp);
+}
+
+/************/
+/* INFOTYPE */
+/************/
+void infoType(int inv, int type) {
+	if (inv < 1 || inv > MAXINVERTERS) return;
+	devType[inv - 1] = type;
+	invInfo[inv - 1].known |= DISC_TYPE;
+	invInfo[inv - 1].tries = 0;
+	invInfo[inv - 1].when = time(NULL);
+	shmPublish(inv);
+	infoSave();
+}
+
+/***************/
+/* INFOVERSION */
+/***************/
+void infoVersion(int inv, unsigned char * v) {
+	if (inv < 1 || inv > MAXINVERTERS) return;
+	memcpy(invInfo[inv - 1].version, v, 8);
+	invInfo[inv - 1].known |= DISC_VERSION;
+	invInfo[inv - 1].tries = 0;
+	invInfo[inv - 1].when = time(NULL);
+	infoSave();
+}
+
+/****************/
+/* DISCOVERNEXT */
+/****************/
+void discoverNext(void) {
+	// Called just before a command is sent. If an active inverter is missing its Device Type or
+	// versions, ask it now: the query goes at once and its reply doesn't restart the pacing gap,
+	// so the command that follows goes when it would have anyway. It only goes if the reply
+	// should be back well within the gap - with -w 0 there is no such gap, so then it waits for
+	// the end of a sweep and costs one round trip per sweep.
+	// Timing is the bus thread's, as it last sent it in a frame: latency[] is not ours to read.
+	// The query carries its own pacing, so the command queued after it is not affected.
+	unsigned char frame[BUFSIZE];
+	int i, inv = 0, fits, len, cmd;
+	
+	if (discoverPending) return;
+	for (i = 0; i < numInverters; i++)
+		if (inverter[i] >= 1 && inverter[i] <= MAXINVERTERS && invInfo[inverter[i] - 1].known != DISC_ALL
+			&& invInfo[inverter[i] - 1].tries < DISCTRIES) {
+			inv = inverter[i];
+			break;
+		}
+	if (inv == 0) return;
+	fits = busRtt[inv] && busGap >= 2 * MINPACE + busRtt[inv];
+	if (!fits && !discoverDue) return;
+	discoverDue = 0;
+	cmd = (invInfo[inv - 1].known & DISC_TYPE) ? GETVERSION : GETDEVICETYPE;
+	TP(TP_TX, tpDiscover, inv, cmd);
+	if ((len = frameBuild(frame, 1, inv, cmd, 0, NULL)) && busSubmit(frame, len, MINPACE, 1) == 0)
+		discoverPending = inv;
+}
+
+/******************/
+/* DISCOVERPACKET */
+/******************/
+void discoverPacket(struct frame * fp) {
+	// The reply to a discovery query, or an empty frame if there wasn't one.
+	// Validated here as processPacket would; nothing else about the current command changes.
+	unsigned char * msg = fp->buf;
+	int inv = discoverPending, i, sum = 0;
+	
+	discoverPending = 0;
+	if (inv < 1 || inv > MAXINVERTERS) return;
+	if (fp->count < 8 || msg[0] != 0x80 || msg[1] != 0x80 || msg[2] != 0x80 || fp->count < msg[3] + 8) {
+		invInfo[inv - 1].tries++;		// Timed out or garbled
+		return;
+	}
+	for (i = 3; i < msg[3] + 7; i++)
+		sum += msg[i];
+	if ((sum & 0xFF) != msg[msg[3] + 7]) {
+		invInfo[inv - 1].tries++;
+		return;
+	}
+	if (msg[6] == GETDEVICETYPE && msg[3] >= 1) {
+		sprintf(buffer, "INFO " PROGNAME " %d Inverter %d Device Type %02x (%s)", controllernum, inv, msg[7], deviceType(msg[7]));
+		logmsg(INFO, buffer);
+		infoType(inv, msg[7]);
+	} else if (msg[6] == GETVERSION && msg[3] == 8) {
+		sprintf(buffer, "INFO " PROGNAME " %d Inverter %d Type %s Version IFC:%02x.%02x.%02x SW:%02x.%02x.%02x.%02x",
+				controllernum, inv, msg[7] == 4 ? "IG+/RS485" : (msg[7] == 5 ? "IG TL/RS485" : "???"),
+				msg[8], msg[9], msg[10], msg[11], msg[12], msg[13], msg[14]);
+		logmsg(INFO, buffer);
+		infoVersion(inv, msg + 7);
+	} else {		// Eg PROTOCOLERROR: the inverter is asleep or doesn't do it
+		TP(TP_DECODE, tpDiscovered, inv, msg[6]);
+		invInfo[inv - 1].tries++;
+	}
+}
+
+/**************/
+/* INFOREPORT */
+/**************/
+void infoReport(int fd, char * cmd) {
+	// GetInfo [n]: info inv:n type:fe rated:1300 card:4 ifc:x.y.z sw:a.b.c.d learnt:t desc:Fronius IG 15 (1300W)
+	// - where not known yet. One line per active inverter.
+	char buffer[300];
+	int from = 1, to = MAXINVERTERS, inv;
+	unsigned char * v;
+	
+	if (sscanf(cmd + 7, "%d", &inv) == 1) {
+		if (inv < 1 || inv > MAXINVERTERS) {
+			sprintf(buffer, "WARN " PROGNAME " %d GetInfo: expected [1-%d]", controllernum, MAXINVERTERS);
+			logmsg(WARN, buffer);
+			return;
+		}
+		from = to = inv;
+	}
+	for (inv = from; inv <= to; inv++) {
+		if (from != to && (inv >= 32 || !(inverterStatus & (1 << inv)))) continue;
+		v = invInfo[inv - 1].version;
+		if (invInfo[inv - 1].known & DISC_TYPE)
+			sprintf(buffer, "info inv:%d type:%02x rated:%d", inv, devType[inv - 1], ratedPower(devType[inv - 1]));
+		else
+			sprintf(buffer, "info inv:%d type:- rated:-", inv);
+		if (invInfo[inv - 1].known & DISC_VERSION)
+			sprintf(buffer + strlen(buffer), " card:%d ifc:%02x.%02x.%02x sw:%02x.%02x.%02x.%02x",
+					v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+		else
+			strcat(buffer, " card:- ifc:- sw:-");
+		sprintf(buffer + strlen(buffer), " learnt:%ld", (long)invInfo[inv - 1].when);
+		if (invInfo[inv - 1].known & DISC_TYPE)
+			sprintf(buffer + strlen(buffer), " desc:%s", deviceType(devType[inv - 1]));
+		sockSend(fd, buffer);
+	}
+}
+
+const char * deviceType(int n) {
 // Return a string for the Device Type
-	switch(n) {
-		case 0xfe: return "Fronius IG 15 (1300W)";
-		case 0xfd: return "Fronius IG 20 (1800W)";
-		case 0xfc: return "Fronius IG 30 (2500W)";
-		case 0xfb: return "Fronius IG 30 DUMMY";
-		case 0xfa: return "Fronius IG 40 (3500W)";
-		case 0xf9: return "Fronius IG 60 (4600W)";
-		case 0xf6: return "Fronius IG 300 (24000W)";
-		case 0xf5: return "Fronius IG 400 (32000W)";
-		case 0xf4: return "Fronius IG 500 (40000W)";
-		case 0xf3: return "Fronius IG 60HV (4600W)";
-		case 0xee: return "Fronius IG 2000";
-		case 0xed: return "Fronius IG 3000";
-		case 0xeb: return "Fronius IG 4000";
-		case 0xea: return "Fronius IG 5100";
-		case 0xe5: return "Fronius IG 2500LV";
-		case 0xe3: return "Fronius IG 4500LV";
-			// Added 1.22
-		case 0xdf:	return "Fronius IG Plus 11.4-3 Delta";
-		case 0xde:	return "Fronius IG Plus 11.4-1 UNI";
-		case 0xdd:	return "Fronius IG Plus 10.0-1 UNI";
-		case 0xdc:	return "Fronius IG Plus 7.5-1 UNI";
-		case 0xdb:	return "Fronius IG Plus 6.0-1 UNI";
-		case 0xda:	return "Fronius IG Plus 5.0-1 UNI";
-		case 0xd9:	return "Fronius IG Plus 3.8-1 UNI";
-		case 0xd8:	return "Fronius IG Plus 3.0-1 UNI";
-		case 0xd7:	return "Fronius IG Plus 120-3 (10000W)";
-		case 0xd6:	return "Fronius IG Plus 70-2 (6500W)";
-		case 0xd5:	return "Fronius IG Plus 70-1 (6500)";
-		case 0xd4:	return "Fronius IG Plus 35-1 (3500W)";
-		case 0xd3:	return "Fronius IG Plus 150-3 (12000W)";
-		case 0xd2:	return "Fronius IG Plus 100-2 (8000W)";
-		case 0xd1:	return "Fronius IG Plus 100-1 (8000W)";
-		case 0xd0:	return "Fronius IG Plus 50-1 (4000W)";
-		case 0xcf:	return "Fronius IG Plus 12.0-3 WYE277";
-		case 0xc1:	return "Fronius IG TL 3.6";
-		case 0xc0:	return "Fronius IG TL 5.0";
-		case 0xbf:	return "Fronius IG TL 4.0";
-		case 0xbe:	return "Fronius IG TL 3.0";
-			// Added 1.30
-		case 0xb1:	return "Fronius IG PLus 35V-1";
-		case 0xb0:	return "Fronius IG PLus 50V-1";
-		case 0xaf:	return "Fronius IG PLus 70V-1";
-		case 0xae:	return "Fronius IG PLus 70V-2";
-		case 0xad:	return "Fronius IG PLus 100V-1";
-		case 0xac:	return "Fronius IG PLus 100V-2";
-		case 0xab:	return "Fronius IG PLus 120V-3";
-		case 0xaa:	return "Fronius IG PLus 150V-3";
-		case 0xa9:	return "Fronius IG PLus V 3.0-1 UNI";
-		case 0xa8:	return "Fronius IG PLus V 3.8-1 UNI";
-		case 0xa7:	return "Fronius IG PLus V 5.0-1 UNI";
-		case 0xa6:	return "Fronius IG PLus V 6.0-1 UNI";
-		case 0xa5:	return "Fronius IG PLus V 7.5-1 UNI";
-		case 0xa4:	return "Fronius IG PLus V 10.0-1 UNI";
-		case 0xa3:	return "Fronius IG PLus V 11.4-1 UNI";
-		case 0xa2:	return "Fronius IG PLus V 11.4-3 DELTA";
-		case 0xa1:	return "Fronius IG PLus V 12.0-3 WYE";
-		case 0xa0:	return "Fronius IG PLus 50V-1 Dummy";
-		case 0x9f:	return "Fronius IG PLus 100V-2 Dummy";
-		case 0x9e:	return "Fronius IG PLus 150V-3 Dummy";
-		case 0x9d:	return "Fronius IG PLus V 3.8-1 Dummy";
-		case 0x9c:	return "Fronius IG PLus V 7.5-1 Dummy";
-		case 0x9b:	return "Fronius IG PLus V 12.0-3 Dummy";
-		case 0xbc:	return "Fronius CL 36.0";
-		case 0xbd:	return "Fronius CL 48.0";
-		case 0xc9:	return "Fronius CL 60.0";
-		case 0xb9:	return "Fronius CL 36.0 WYE277";
-		case 0xba:	return "Fronius CL 48.0 WYE277";
-		case 0xbb:	return "Fronius CL 60.0 WYE277";
-		case 0xb6:	return "Fronius CL 33.3 Delta";
-		case 0xb7:	return "Fronius CL 44.4 Delta";
-		case 0xb8:	return "Fronius CL 55.5 Delta";
-		case 0x9a:	return "Fronius CL 60.0 Dummy";
-		case 0x99:	return "Fronius CL 55.5 Delta Dummy";
-		case 0x98:	return "Fronius CL 60.0 WYE277 Dummy";
-
-		case 0xff: return "Fronius UNKNOWN";
-		default:
-			DEBUG fprintf(DEBUGFP, "Unknown Device Type %02x\n", n);
-			return "Unknown Device Type";
-	}
-}
-
-char * protocolError(int n) {
-	switch(n) {
-		case 1:  return "Unknown Command(1)";
-		case 2:  return "Timeout(2)";
-		case 3:  return "Incorrect data supplied(3)";
-		case 4:  return "Command Queue full(4)";
-		case 5:  return "Device not present(5)";
-		case 6:  return "No response from device(6)";
-		case 7:  return "Sensor Error(7)";
-		case 8:  return "Sensor not active(8)";
-		case 9:  return "Incorrect command(9)";
-		case 10: return "Address Conflict(10)";
-		default: return "Unknown error code";
-	}
-}			
+	if (n >= 0 && n < 256 && dictDevice[n]) return dictDevice[n];
+	TP(TP_DECODE, tpDevice, n);
+	return "Unknown Device Type";
+}
+
+const char * protocolError(int n) {
+	if (n >= 0 && n < DICT_PROTOCOL && dictProtocol[n]) return dictProtocol[n];
+	return "Unknown error code";
+}
 			
 ////////////////
 /* GETVERSION */
@@ -1287,10 +2498,14 @@ return version;
 /////////////
 char * getTime(void) {
 // Return pointer to string in form yyyy/mm/dd hh:mm:ss
+// 1.55 Only formatted when the second changes
 	static char buf [20];		// overrides global buf
+	static time_t last = 0;
 	struct tm * mytm;
 	time_t timeval;
 	timeval = time(NULL);
+	if (timeval == last) return buf;
+	last = timeval;
 	mytm = localtime(&timeval);
 	sprintf(buf, "%4d/%02d/%02d %02d:%02d:%02d", mytm->tm_year + 1900, mytm->tm_mon+1,
 		mytm->tm_mday, mytm->tm_hour, mytm->tm_min, mytm->tm_sec);
@@ -1300,250 +2515,1914 @@ char * getTime(void) {
 /***************/
 /* SANITYCHECK */
 /***************/
-float sanitycheck(float value, int index, float prev, char * count) {
-	// Check that supplied value is sensible. If not, return previous value but warn.
+int sanitycheck(float value, int index, int invnum, int exp) {
+	// Check that supplied value is sensible: return 1 to accept it, 0 to keep the previous value and warn.
+	// Exp is the frame's exponent: the energy counters move in steps of 10^exp Wh.
 	// Also check that the index itself is sensible
-    // Count is a pointer so it can be reset
 	// First, if count = 2 or more, accept value.
 	// 2.28 - look for sudden (downward) AC Voltage changes.
-	if (*count > 2) {
+	// 1.42 - Fixed limits were right for a 5kW inverter, wrong for an IG 500 and loose for an IG 15.
+	// Limits now scale with the rated power of the device type (DEFRATED if unknown), and
+	// a value more than STATSK deviations plus a floor away from its running mean is also suspect.
+	// Only accepted values feed the statistics; zero (inverter off) is always accepted.
+	int i = index - VARSTART;
+	int inv = invnum - 1;
+	float prev = responseVal[inv][i];
+	char * cp = &count[inv][i];
+	struct stats * sp = &stats[inv][i];
+	time_t now = time(NULL);
+	float rated = devType[inv] ? ratedPower(devType[inv]) : 0;
+	float limit = 0, floor = 0, dev;
+	char * what = NULL;
+	int brownout = 0;		// AC Voltage crossing 200V with DC present: shutdown or recovery
+	
+	if (rated <= 0) rated = DEFRATED;
+	if (index < VARSTART || index > VAREND) {
+		sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely index value of %d", controllernum + inv, index);
+		logmsg(WARN, buffer);
+		return 0;
+	}
+	if (index == 21 && responseVal[inv][24 - VARSTART] > 0.0 && ((value < 200 && prev > 200) || (value > 200 && prev < 200)))
+		brownout = 1;		// An outlier by any measure, but real: never discarded, always reported
+	if (*cp > 2) {
 		sprintf(buffer, "INFO " PROGNAME " %d Accepting value(%d) of %.1f as valid as count=%d although prev=%.1f",
-				controllernum + currentInverter, index, value, *count, prev);
+				controllernum + inv, index, value, *cp, prev);
 		logmsg(INFO, buffer);
-		*count = 0;
-		return value;
+		*cp = 0;
+		sp->n = 0;		// level has changed - relearn
+		goto accept;
 	}
 	switch(index) {
 		case 16:	// current power
-			if (value > 10000) {
-				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely POWER NOW value of %.1f", controllernum + currentInverter, value);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return prev;
-			}
+			limit = rated * HEADROOM;
+			floor = rated;			// clouds - anything up to full swing
+			what = "POWER NOW";
 			break;
 		case 17:	// Energy todate
 		case 18:	// Energy today
 		case 19: // Energy this year
-			if ((prev > 0) && (value > prev + 10000)) {
-				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely ENERGY(%d) value of %.1f (prev %.1f)", controllernum + currentInverter, index, value, prev);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return prev;
+			// Can only rise at up to rated power, plus one step of the counter (10^exp Wh)
+			if (prev > 0) {
+				limit = prev + 10000;
+				if (sp->last && prev + rated * HEADROOM * (now - sp->last) / 3600.0 + tentothe(exp) < limit)
+					limit = prev + rated * HEADROOM * (now - sp->last) / 3600.0 + tentothe(exp);
 			}
+			what = "ENERGY";
 			break;
 		case 20:	// AC Current
-			if (value > 100) {
-				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely AC Current value of %.1f", controllernum + currentInverter, value);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return prev;
-			}
+			limit = rated * HEADROOM / 100.0;	// Generous: 100V single phase
+			if (limit < 5) limit = 5;
+			floor = limit;
+			what = "AC Current";
 			break;
 		case 21:	// AC VOLTAGE - permissiable range now includes 3-phase AC
-			if (value > 550) {
-				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely AC Voltage value of %.1f", controllernum + currentInverter, value);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return prev;
-			}
-			float vdc, idc;
-			idc = responseVal[currentInverter][23 - VARSTART];
-			vdc = responseVal[currentInverter][24 - VARSTART];
-			// 2.28 - report sudden voltage reduction
-			if (value < 200 && prev > 200 && vdc > 0.0) {
-				sprintf(buffer, "WARN " PROGNAME " %d ACV = %.1f, previously %.1f. (Vdc %.1f Idc %.2f) Inverter shutdown (DC brownout)", 
-						controllernum + currentInverter, value, prev, responseVal[currentInverter][24 - VARSTART], responseVal[currentInverter][23 - VARSTART]);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return value;	// Note NOT returning previous!
-			}
-			if (value > 200 && prev < 200 && vdc > 0.0) {
-				sprintf(buffer, "WARN " PROGNAME " %d ACV = %.1f, previously %.1f. (Vdc %.1f Idc %.2f) Recovery from Inverter shutdown", 
-						controllernum + currentInverter, value, prev, responseVal[currentInverter][24 - VARSTART], responseVal[currentInverter][23 - VARSTART]);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return value;	// Note NOT returning previous!
-			}
+			limit = 550;
+			floor = 30;
+			what = "AC Voltage";
 			break;
 		case 22:	// AC Frequency
-			if (value > 100) {
-				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely AC Frequency value of %.1f", controllernum + currentInverter, value);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return prev;
-			}
+			limit = 100;
+			floor = 2;
+			what = "AC Frequency";
 			break;
 		case 23:	// DC Current
-			if (value > 100) {
-				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely DC Current value of %.1f", controllernum + currentInverter, value);
-				logmsg(WARN, buffer);
-				(*count)++;
-				return prev;
-			}
+			limit = rated * HEADROOM / 100.0;	// DC input is never below 100V at full power
+			if (limit < 5) limit = 5;
+			floor = limit;
+			what = "DC Current";
 			break;
 		case 24:	// DC VOLTAGE
-			if (value > 600) {
-				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely DC Voltage value of %.1f", controllernum + currentInverter, value);
+			limit = rated > 20000 ? 1000 : 600;	// Central inverters have higher DC strings
+			floor = 150;
+			what = "DC Voltage";
+			break;
+	}
+	if (limit > 0 && value > limit) {
+		TP(TP_SANITY, tpLimit, invnum, index, tpFloat(value), tpFloat(limit));
+		if (++(*cp) == 1)
+			sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely %s(%d) value of %.1f (prev %.1f limit %.1f)", 
+					controllernum + inv, what, index, value, prev, limit);
+		else
+			sprintf(buffer, "INFO " PROGNAME " %d Discarding unlikely %s(%d) value of %.1f (prev %.1f limit %.1f) count %d", 
+					controllernum + inv, what, index, value, prev, limit, *cp);
+		logmsg(*cp == 1 ? WARN : INFO, buffer);
+		return 0;
+	}
+	if (value != 0.0 && !brownout && sp->n >= STATSWARMUP && now - sp->last < STATSSTALE && floor > 0) {
+		dev = value - sp->mean;
+		if (dev < 0) dev = -dev;
+		if (dev > STATSK * sqrtf(sp->var) + floor) {
+			(*cp)++;
+			TP(TP_SANITY, tpOutlier, invnum, index, tpFloat(value), tpFloat(sp->mean), tpFloat(sqrtf(sp->var)), *cp);
+			if (*cp == 1) {
+				sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely %s(%d) value of %.1f (mean %.1f sd %.2f)", 
+						controllernum + inv, what, index, value, sp->mean, sqrtf(sp->var));
 				logmsg(WARN, buffer);
-				(*count)++;
-				return prev;
 			}
-			break;
-		default:
-			sprintf(buffer, "WARN " PROGNAME " %d Discarding unlikely index value of %d", controllernum + currentInverter, index);
+			return 0;
+		}
+	}
+	*cp = 0;
+accept:
+	if (brownout) {
+		float vdc, idc;
+		idc = responseVal[inv][23 - VARSTART];
+		vdc = responseVal[inv][24 - VARSTART];
+		// 2.28 - report sudden voltage reduction
+		if (value < 200 && prev > 200 && vdc > 0.0) {
+			sprintf(buffer, "WARN " PROGNAME " %d ACV = %.1f, previously %.1f. (Vdc %.1f Idc %.2f) Inverter shutdown (DC brownout)", 
+					controllernum + inv, value, prev, vdc, idc);
+			logmsg(WARN, buffer);
+			sp->n = 0;
+		}
+		if (value > 200 && prev < 200 && vdc > 0.0) {
+			sprintf(buffer, "WARN " PROGNAME " %d ACV = %.1f, previously %.1f. (Vdc %.1f Idc %.2f) Recovery from Inverter shutdown", 
+					controllernum + inv, value, prev, vdc, idc);
 			logmsg(WARN, buffer);
-			(*count)++;
-			return prev;
+			sp->n = 0;
+		}
 	}
-	*count = 0;
-	return value;
+	if (value != 0.0) {	// Zero is the inverter being off, not a sample of the distribution
+		if (sp->n == 0 || now - sp->last >= STATSSTALE) {
+			sp->mean = value;
+			sp->var = 0;
+			sp->n = 0;
+		} else {
+			dev = value - sp->mean;
+			sp->mean += dev / 16;
+			sp->var += (dev * dev - sp->var) / 16;
+		}
+		sp->n++;
+	}
+	sp->last = now;
+	return 1;
 }
 
-/**********/
-/* GETBUF */
-/**********/
-int getbuf(int fd, int max, int mSec) {
-	// Read up to max chars into supplied buf. Return number
-	// of chars read or negative error code if applicable
-	
-	int ready, numtoread, now;
-	fd_set readfd; 
-	struct timeval timeout;
-	FD_ZERO(&readfd);
-	// numread = 0;
-	numtoread = max;
-	DEBUG2 fprintf(stderr, "Getbuf %d count=%d ", max ,data.count);
-	
-	while(1) {
-		FD_SET(fd, &readfd);
-		timeout.tv_sec = mSec / 1000;
-		timeout.tv_usec = (mSec * 1000) % 1000000;	 // 0.5sec
-		ready = select(fd + 1, &readfd, NULL, NULL, &timeout);
-		DEBUG4 {
-			gettimeofday(&timeout, NULL);
-			fprintf(stderr, "%03ld.%03ld ", timeout.tv_sec%100, timeout.tv_usec / 1000);
-		}
-		if (ready == 0) 
-			return data.count;		// timed out - return what we've got
-		DEBUG4 fprintf(stderr, "Getbuf: before read1 ");
-		now = read(fd, data.buf + data.count, 1);
-		DEBUG4 fprintf(stderr, "After read1\n");
-		DEBUG3 fprintf(stderr, "0x%02x ", data.buf[data.count]);
-		if (now < 0)
-			return now;
-		if (now == 0) {
-			fprintf(stderr, "ERROR fd was ready but got no data\n");
-			fd = reopenSerial(fd, serialName, BAUD, 0, CS8, 1);
-			//			usleep(1000000); // 1 Sec
-			continue;
-		}
-		// For Elster don't care if SYNC byte found in middle of data
-		/*		if (data.buf[data.count] == STARTSYNC && data.count != 0) {
-		 sprintf(buffer, "WARN " PROGNAME " got 0x01 at position %d in packet", data.count);
-		 logmsg(WARN, buffer);
-		 return -1;
-		 }
-		 if (data.buf[data.count] == STARTSYNC)
-		 return 0;
-		 */		
-		data.count += now;
-		numtoread -= now;
-		if (numtoread == 0) return data.count;
-		if (numtoread < 0) {	// CANT HAPPEN
-			fprintf(stderr, "ERROR buffer overflow - increase max from %d (numtoread = %d numread = %d)\n", 
-					max, numtoread, data.count);
-			return data.count;
-			
-		}
+/**************/
+/* RATEDPOWER */
+/**************/
+int ratedPower(int n) {
+	// Nominal AC output in Watts for a Device Type, 0 if not known. See fronius.dict
+	return (n >= 0 && n < 256) ? dictRated[n] : 0;
+}
+
+/******************/
+/* PLANTRECOMPUTE */
+/******************/
+void plantRecompute(void) {
+	// Sum from scratch when the set of active inverters changes, and at the end of each sweep
+	// so the error of plantUpdate's running sums never builds up.
+	int inv, i;
+	bzero(plant.sum, sizeof(plant.sum));
+	for (inv = 1; inv <= MAXINVERTERS; inv++)
+		if (inv < 32 && (inverterStatus & (1 << inv)))
+			for (i = 0; i < VAREND - VARSTART + 1; i++)
+				plant.sum[i] += responseVal[inv - 1][i];
+}
+
+/***************/
+/* PLANTUPDATE */
+/***************/
+void plantUpdate(int invnum, int i, float prev, float value) {
+	// Keep the running sums and the per-sweep extremes as each value is accepted.
+	if (invnum >= 32 || !(inverterStatus & (1 << invnum))) return;
+	plant.sum[i] += (double) value - prev;
+	if (i == 0x15 - VARSTART && value > 0) {	// AC Voltage. Zero is an inverter that is off.
+		if (plant.vacMin == 0 || value < plant.vacMin) plant.vacMin = value;
+		if (value > plant.vacMax) plant.vacMax = value;
+	}
+	if (i == 0x10 - VARSTART) {	// Power now - the age spread is measured on this
+		double t = sampleTime[invnum - 1][i];
+		if (plant.first == 0 || t < plant.first) plant.first = t;
+		if (t > plant.last) plant.last = t;
+	}
+}
+
+/*************/
+/* PLANTSEND */
+/*************/
+void plantSend(void) {
+	// One record per sweep so the server needn't add up the inverters. Spread is the time
+	// between the first and last inverter's power reading. Fronius reports one AC current
+	// and voltage per inverter, so there is no per-phase breakdown.
+	char buffer[256];
+	plantRecompute();		// 12 x 9 additions: no rounding carried from sweep to sweep
+	if (servers > 1 && dataFormat == dataDictionary && noserver == 0) {
+		sprintf(buffer, "plant inverters:%d watts:%.0f kwh:%.1f iac:%.2f idc:%.2f vacmin:%.1f vacmax:%.1f spread:%.1f",
+				numInverters, plant.sum[0], plant.sum[1] / 1000.0, plant.sum[4], plant.sum[7], 
+				plant.vacMin, plant.vacMax, plant.last - plant.first);
+		TP(TP_SOCKET, tpSend, 0, strlen(buffer));
+		sinkRecord(0, buffer);
+	}
+	plant.vacMin = plant.vacMax = 0;
+	plant.first = plant.last = 0;
+	batchFlush();
+}
+
+/***********/
+/* INVSOCK */
+/***********/
+int invSock(int invnum) {
+	// Each inverter has its own connection unless multiplexed. Anything else uses the first.
+	if (multiplex || invnum < 1 || invnum > numsockets) return sockfd[0];
+	return sockfd[invnum - 1];
+}
+
+/************/
+/* BATCHADD */
+/************/
+void batchAdd(int invnum, char * record) {
+	// Multiplexed records are tagged inv:N (0 for plant-wide) and collected for one write per sweep:
+	//	batch <count>\ninv:1 inverter watts:...\ninv:2 inverter watts:...\ninv:0 plant ...
+	int len = strlen(record) + 12;
+	if (batchlen + len + 20 >= BATCHSIZE) batchFlush();	// 20 for the header
+#ifdef TINY
+	batchlen = fmtStr(fmtStr(fmtInt(fmtStr(batch + batchlen, "\ninv:"), invnum), " "), record) - batch;
+#else
+	batchlen += sprintf(batch + batchlen, "\ninv:%d %s", invnum, record);
+#endif
+	batchcount++;
+}
+
+/**************/
+/* BATCHFLUSH */
+/**************/
+void batchFlush(void) {
+	char head[20];
+	int hlen;
+	if (batchcount == 0 || noserver) {
+		batchlen = batchcount = 0;
+		return;
 	}
+	// The header goes in front of the records; there is room as the records start at batch[0]
+	hlen = sprintf(head, "batch %d", batchcount);
+	memmove(batch + hlen, batch, batchlen + 1);
+	memcpy(batch, head, hlen);
+	TP(TP_SOCKET, tpSend, -1, strlen(batch));
+	sockSend(sockfd[0], batch);
+	batchlen = batchcount = 0;
 }
 
 /***********/
-/* DUMPBUF */
+/* SINKADD */
 /***********/
-void dumpbuf() {
+int sinkAdd(char * spec) {
+	// type[:where][,queue=n][,drop=new|old] from -o. Return 0 if it makes no sense.
+	// mcp and shm are there from the start: no: in front takes them out, and naming them is no change.
+	struct sink * sp = &sink[numSinks];
+	char copy[200], * cp, * opt;
+	int t;
+	if (strncasecmp(spec, "no", 2) == 0) {
+		for (t = 0; t < numSinks; t++)
+			if ((sink[t].type == mcpSink || sink[t].type == shmSink) && strcasecmp(spec + 2, sinkName[sink[t].type]) == 0) {
+				memmove(&sink[t], &sink[t + 1], (numSinks - t - 1) * sizeof(sink[0]));
+				numSinks--;
+				return 1;
+			}
+		return strcasecmp(spec, "nomcp") == 0 || strcasecmp(spec, "noshm") == 0;	// Already gone
+	}
+	if ((strcasecmp(spec, "mcp") == 0 && sinkWanted(mcpSink)) || (strcasecmp(spec, "shm") == 0 && sinkWanted(shmSink)))
+		return 1;
+	if (numSinks == MAXSINKS) return 0;
+	strncpy(copy, spec, sizeof(copy) - 1);
+	copy[sizeof(copy) - 1] = '\0';
+	opt = strchr(copy, ',');
+	if (opt) *opt++ = '\0';
+	if ((cp = strchr(copy, ':'))) *cp++ = '\0';
+	for (t = mcpSink; t <= mcastSink && strcasecmp(copy, sinkName[t]); t++) ;
+	if (t > mcastSink || ((t == fileSink || t == udpSink || t == mcastSink) != (cp && *cp))) return 0;
+	bzero(sp, sizeof(*sp));
+	sp->type = t;
+	sp->fd = -1;
+	sp->size = SINKQUEUE;
+	sp->ttl = 1;
+	if (cp) strncpy(sp->where, cp, sizeof(sp->where) - 1);
+	for (opt = opt ? strtok(opt, ",") : NULL; opt; opt = strtok(NULL, ","))
+		if (strncasecmp(opt, "queue=", 6) == 0 && (sp->size = atoi(opt + 6)) > 0 && sp->size <= MAXSINKQUEUE) ;
+		else if (strcasecmp(opt, "drop=old") == 0) sp->dropOld = 1;
+		else if (strcasecmp(opt, "drop=new") == 0) sp->dropOld = 0;
+		else if (strncasecmp(opt, "ttl=", 4) == 0) sp->ttl = atoi(opt + 4);
+		else return 0;
+	numSinks++;
+	return 1;
+}
+
+/**************/
+/* SINKWANTED */
+/**************/
+int sinkWanted(int type) {
 	int i;
-	for (i = 0; i < data.count; i++) {
-		fprintf(stderr, "%02x", data.buf[i]);
-		if (i % 6 == 3)
-			putc('-', stderr);
-		else
-			putc(' ', stderr);
+	for (i = 0; i < numSinks; i++)
+		if (sink[i].type == type) return 1;
+	return 0;
+}
+
+/************/
+/* SINKOPEN */
+/************/
+int sinkOpen(struct sink * sp) {
+	// Return the file or connected UDP socket, or -1 with errno set. For mcast the group is
+	// the host and the socket doesn't block: a datagram that can't go at once is dropped.
+	char host[128], * port;
+	struct hostent * hp;
+	struct sockaddr_in addr;
+	int fd, err;
+	if (sp->type == fileSink)
+		return open(sp->where, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	strcpy(host, sp->where);
+	if ((port = strchr(host, ':')) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	*port++ = '\0';
+	if ((hp = gethostbyname(host)) == NULL) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port));
+	memcpy(&addr.sin_addr, hp->h_addr, sizeof(addr.sin_addr));
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return -1;
+	if (sp->type == mcastSink) {
+		unsigned char ttl = sp->ttl;
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
 	}
-	putc('\n', stderr);
+	return fd;
 }
 
-char * statusText(int n) {
-	switch(n) {
-			// Class 100 - typically temporary
-		case 102:	return "AC Voltage too high";
-		case 103:	return "AC Voltage too low";
-		case 105:	return "AC frequency too high";
-		case 106:	return "AC frequency too low";
-		case 107:	return "NO AC Grid detected";
-		case 108:	return "Islanding detected";
-		case 112:	return "RMCU: Fault current in inverter";
-		
-			// Class 300 - non-permanent error during feed-in
-		case 301:	return "Overcurrent AC";
-		case 302:	return "Overcurrent DC";
-		case 303:	return "Overtemperature DC side";
-		case 304:	return "Overtemperature internally";
-		case 305:	return "No power transfer to grid possible";
-		case 306:	return "Power too low";
-		case 307:	return "DC too low";
-		case 308:	return "Intermediate circuit voltage too high";
-		case 309:	return "DC inpt voltage too high";
-			
-			// Class 400 - probable hardware problem
-		case 401:	return "No communication with power stage";
-		case 406:
-		case 407:	return "Error in temperature sensor";
-		case 408:	return "Direct current feed-in";
-		case 412:	return "Fixed voltage mode - out of range";
-		case 416:	return "No communication between power stage and control unit";
-		case 425:	return "Communication with power stage set not possible";
-		case 426:	return "Intermediate circuit charging takes too long";
-		case 427:	return "Power stage inoperative for too long";
-		case 428:	return "Timeout error during connection";
-		case 429:	return "Timeout error when disconneting";
-		case 431:	return "Power stage software being updated";
-		case 432:	return "Internal database error during power st allocation";
-		case 433:	return "No dynamic indentification can be assigned to power stage";
-		case 436:	return "Incorrect error information from power stage";
-		case 437:	return "General troubleshooting in power stage";
-		case 438:	return "Incorrect error information from power stage";
-		case 442:	return "Power stage set not detected";
-		case 443:	return "Energy transfer not possible";
-		case 445:	return "Invalid power stage set configuration";
-		case 447:	return "Solar module ground insulation error";
-		case 450:	return "Error in Guard Control";
-		case 451:	return "Guard Control memory faulty";
-		case 452:	return "Communication between Guard and DSP interrupted";
-		case 453:	return "Error in grid voltage recorded by Guard Control";
-		case 454:	return "Error in grid frequency recorded by Guard Control";
-		case 456:	return "Error in islanding check by Guard Control";
-		case 457:	return "Grid relay defective";
-		case 458:	return "DPS and Guard Control measure different RMCU values";
-		case 459:	return "Measurement signal recording not possible for insulation test";
-		case 460:	return "Reference source for DPS is outside tolerance";
-		case 461:	return "Error in DSP memory";
-		case 462:	return "Error in DC-feed monitoring routine";
-		case 463:	return "AC polarity inverter";
-		case 474:	return "RMCU sensor is defective";
-		case 475:	return "Error in safety relay";
-		case 476:	return "Internal component defective";
-			
-			// Class 500 - limitation in greed feed
-		case 509:	return "No feed-in in last 24 hours - snow on panels?";
-		case 515:	return "No communication with string monitor";
-		case 516:	return "No communication with memory unit";
-		case 517:	return "Power derating due to excessive temperature";
-		case 518:	return "Internal DSP malfunction";
-			
-			// Class 700 - inverter control and interface
-		default:	return "(No message available)";
+/*************/
+/* SINKSTART */
+/*************/
+void sinkStart(void) {
+	// Open files and UDP sockets and start a thread for each. MCP records share their connection
+	// with logmsg and the commands, so they stay on the main thread; shm is a memcpy, and its
+	// updates go as each value is accepted (shmPublish), so neither has a queue.
+	// A sink that can't be opened is logged and left out.
+	struct sink * sp;
+	int i;
+	for (i = 0; i < numSinks; i++) {
+		sp = &sink[i];
+		if (sp->type != fileSink && sp->type != udpSink && sp->type != mcastSink) continue;
+		if ((sp->fd = sinkOpen(sp)) >= 0 && sp->type == mcastSink)
+			continue;		// Sent from the main thread as values arrive, no queue
+		if (sp->fd >= 0) {
+			if ((sp->q = malloc(sp->size * SINKREC)) == NULL) {
+				sprintf(buffer, "WARN " PROGNAME " %d No memory for %d record queue of %s sink %s", controllernum, sp->size, sinkName[sp->type], sp->where);
+				logmsg(WARN, buffer);
+				close(sp->fd);
+				sp->fd = -1;
+				continue;
+			}
+			pthread_mutex_init(&sp->lock, NULL);
+			pthread_cond_init(&sp->more, NULL);
+			if (threadStart(&sp->tid, sinkThread, sp) == 0) {
+				sp->running = 1;
+				continue;
+			}
+			free(sp->q);
+			sp->q = NULL;
+			close(sp->fd);
+			sp->fd = -1;
+		}
+		sprintf(buffer, "WARN " PROGNAME " %d Can't open %s sink %s: %s", controllernum, sinkName[sp->type], sp->where, strerror(errno));
+		logmsg(WARN, buffer);
 	}
 }
 
+/************/
+/* SINKSTOP */
+/************/
+void sinkStop(void) {
+	int i;
+	sinkQuit = 1;
+	for (i = 0; i < numSinks; i++)
+		if (sink[i].running) {
+			pthread_mutex_lock(&sink[i].lock);
+			pthread_cond_signal(&sink[i].more);
+			pthread_mutex_unlock(&sink[i].lock);
+			pthread_join(sink[i].tid, NULL);
+			sink[i].running = 0;
+			close(sink[i].fd);
+		}
+}
+
+/**************/
+/* SINKRECORD */
+/**************/
+void sinkRecord(int invnum, char * record) {
+	// The fan-out. Never waits on a file or UDP sink: if its queue is full a record is dropped
+	// there, and only there. inv: is 0 for plant-wide records.
+	// One too long for a queue slot still goes to mcp; the queued sinks count it as dropped.
+	struct sink * sp;
+	char line[SINKREC], msg[100];
+	int i, fits = strlen(record) <= SINKREC - 40;	// 40 for the time and inv: prefix
+	static int warned = 0;
+	traceEmit();
+	if (!fits && !warned++) {
+		sprintf(msg, "WARN " PROGNAME " %d %d byte record too long for file and udp sinks (max %d)", controllernum, (int)strlen(record), SINKREC - 40);
+		logmsg(WARN, msg);
+	}
+	if (fits)
+#ifdef TINY
+		fmtStr(fmtStr(fmtInt(fmtStr(fmtFixed(line, timeNow(), 3), " inv:"), invnum), " "), record);
+#else
+		sprintf(line, "%.3f inv:%d %s", timeNow(), invnum, record);
+#endif
+	for (i = 0; i < numSinks; i++) {
+		sp = &sink[i];
+		if (sp->type == mcpSink) {
+			if (multiplex)
+				batchAdd(invnum, record);
+			else
+				sockSend(invSock(invnum), record);
+			sp->sent++;
+			continue;
+		}
+		if (!sp->running) continue;
+		pthread_mutex_lock(&sp->lock);
+		if (!fits) {
+			sp->dropped++;
+			pthread_mutex_unlock(&sp->lock);
+			continue;
+		}
+		if (sp->count == sp->size) {
+			sp->dropped++;
+			if (sp->dropOld) {
+				sp->head = (sp->head + 1) % sp->size;
+				sp->count--;
+			}
+		}
+		if (sp->count < sp->size) {
+			strcpy(sp->q[(sp->head + sp->count) % sp->size], line);
+			sp->count++;
+			pthread_cond_signal(&sp->more);
+		}
+		pthread_mutex_unlock(&sp->lock);
+	}
+}
+
+/**************/
+/* SINKTHREAD */
+/**************/
+void * sinkThread(void * arg) {
+	// One per file or UDP sink. Takes the oldest record and writes it with the lock released.
+	// At shutdown carries on until the queue is empty.
+	struct sink * sp = arg;
+	char rec[SINKREC + 1];
+	int len, ok;
+	pthread_mutex_lock(&sp->lock);
+	for (;;) {
+		while (sp->count == 0 && !sinkQuit)
+			pthread_cond_wait(&sp->more, &sp->lock);
+		if (sp->count == 0) break;
+		strcpy(rec, sp->q[sp->head]);
+		sp->head = (sp->head + 1) % sp->size;
+		sp->count--;
+		pthread_mutex_unlock(&sp->lock);
+		len = strlen(rec);
+		if (sp->type == fileSink) rec[len++] = '\n';	// A datagram needs no terminator
+		ok = write(sp->fd, rec, len) == len;
+		pthread_mutex_lock(&sp->lock);
+		if (ok) sp->sent++;
+		else sp->failed++;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
+}
+
+/**************/
+/* SINKREPORT */
+/**************/
+void sinkReport(int fd) {
+	// sinks n\n<type> <where> queued:q/size sent:s dropped:d failed:f state:ok|closed
+	char buffer[BATCHSIZE];
+	struct sink * sp;
+	int i, len;
+	len = sprintf(buffer, "sinks %d", numSinks);
+	for (i = 0; i < numSinks; i++) {
+		sp = &sink[i];
+		if (sp->running) pthread_mutex_lock(&sp->lock);
+		len += sprintf(buffer + len, "\n%s %s queued:%d/%d sent:%d dropped:%d failed:%d state:%s",
+					   sinkName[sp->type], sp->where[0] ? sp->where : "-", sp->count, sp->size,
+					   sp->sent, sp->dropped, sp->failed,
+					   sp->running || sp->type == mcpSink || (sp->type == shmSink && shm)
+					   || (sp->type == mcastSink && sp->fd >= 0) ? "ok" : "closed");
+		if (sp->running) pthread_mutex_unlock(&sp->lock);
+	}
+	sockSend(fd, buffer);
+}
+
+/****************/
+/* MCASTPUBLISH */
+/****************/
+void mcastPublish(int invnum, int i) {
+	// One datagram per value, sent as soon as sanitycheck accepts it; a rejected value is never
+	// sent. A full socket buffer drops it; the subscriber sees the gap in seq.
+	struct fronius_mcast d;
+	struct sink * sp;
+	uint32_t bits;
+	double t = sampleTime[invnum - 1][i];
+	int n, sent = 0;
+	for (n = 0; n < numSinks; n++) {
+		sp = &sink[n];
+		if (sp->type != mcastSink || sp->fd < 0) continue;
+		if (!sent++) {		// Built once, for the first mcast sink
+			d.magic = htonl(FRONIUS_MCAST_MAGIC);
+			d.version = FRONIUS_MCAST_VERSION;
+			d.controller = controllernum;
+			d.inverter = invnum;
+			d.index = i;
+			d.seq = htonl(mcastSeq++);
+			d.rxsec = htonl((uint32_t) t);
+			d.rxusec = htonl((uint32_t) ((t - (uint32_t) t) * 1000000));
+			memcpy(&bits, &responseVal[invnum - 1][i], sizeof(bits));
+			d.value = htonl(bits);
+		}
+		if (send(sp->fd, &d, sizeof(d), MSG_DONTWAIT) == sizeof(d)) {
+			sp->sent++;
+			traceEmit();
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			sp->dropped++;
+		else
+			sp->failed++;
+	}
+}
+
+/**************/
+/* ALIGNPARSE */
+/**************/
+int alignParse(char * spec) {
+	// N[:watts,iac,..] Return 0 if it makes no sense
+	char * cp;
+	int i;
+	if ((align.period = atoi(spec)) <= 0) return 0;
+	align.mask = 0;
+	if ((cp = strchr(spec, ':')))
+		for (cp = strtok(cp + 1, ","); cp; cp = strtok(NULL, ",")) {
+			for (i = 0; i < VAREND - VARSTART + 1 && strcasecmp(cp, valueName[i]); i++) ;
+			if (i == VAREND - VARSTART + 1) return 0;
+			align.mask |= 1 << i;
+		}
+	if (align.mask == 0) align.mask = 1 << (0x10 - VARSTART);
+	align.next = (time(NULL) / align.period + 1) * align.period;
+	return 1;
+}
+
+/************/
+/* ALIGNDUE */
+/************/
+int alignDue(void) {
+	return align.period && numInverters && time(NULL) >= align.next;
+}
+
+/**************/
+/* ALIGNBEGIN */
+/**************/
+void alignBegin(void) {
+	// Value by value, each across all the inverters. The spread of one value is then a single
+	// pass of the inverters, not a whole sweep; watts, lowest index, goes first, nearest the boundary.
+	int i;
+	time_t now = time(NULL);
+	align.at = align.next;
+	align.next = (now / align.period + 1) * align.period;	// Skip boundaries missed altogether
+	for (align.nvals = 0, i = 0; i < VAREND - VARSTART + 1; i++)
+		if (align.mask & (1 << i)) align.val[align.nvals++] = i;
+	align.ninv = numInverters;
+	memcpy(align.inv, inverter, sizeof(align.inv));
+	bzero(align.first, sizeof(align.first));
+	bzero(align.last, sizeof(align.last));
+	align.got = 0;
+	align.watts = 0;
+	align.steps = align.nvals * align.ninv;
+	align.step = -1;
+	alignStep();
+}
+
+/*************/
+/* ALIGNSTEP */
+/*************/
+int alignStep(void) {
+	if (++align.step >= align.steps) {
+		alignReport();
+		return 0;
+	}
+	staticInfo.target = align.inv[align.step % align.ninv];
+	staticInfo.commandIndex = VARSTART + align.val[align.step / align.ninv];
+	return 1;
+}
+
+/***************/
+/* ALIGNREPORT */
+/***************/
+void alignReport(void) {
+	// aligned inverters:3 at:<boundary> late:<s to first reading> span:<s to last> readings:n/m
+	//	watts:<sum> wattsskew:<s> vacskew:<s> ..
+	// skew is the time between the first and last inverter's reading of that value.
+	char buffer[400];
+	double first = 0, last = 0;
+	int i, j, len;
+	for (j = 0; j < align.nvals; j++) {
+		i = align.val[j];
+		if (align.first[i] && (first == 0 || align.first[i] < first)) first = align.first[i];
+		if (align.last[i] > last) last = align.last[i];
+	}
+	len = sprintf(buffer, "aligned inverters:%d at:%ld late:%.3f span:%.3f readings:%d/%d", align.ninv, (long) align.at,
+				  first ? first - align.at : 0.0, first ? last - first : 0.0, align.got, align.steps);
+	if (align.mask & (1 << (0x10 - VARSTART)))
+		len += sprintf(buffer + len, " watts:%.0f", align.watts);
+	for (j = 0; j < align.nvals; j++) {
+		i = align.val[j];
+		len += sprintf(buffer + len, " %sskew:%.3f", valueName[i], align.first[i] ? align.last[i] - align.first[i] : 0.0);
+	}
+	TP(TP_SOCKET, tpSend, 0, strlen(buffer));
+	sinkRecord(0, buffer);
+	batchFlush();
+}
+
+/**************/
+/* TRACEBEGIN */
+/**************/
+unsigned int traceBegin(unsigned char * buf, int idle) {
+	// 1.61 Main thread. Start a span for the command in buf; return its id for the frame.
+	// A handful of clock reads per command, so it is always on.
+	struct span * sp;
+	if (++traceSeq == 0) traceSeq = 1;		// 0 means none
+	sp = &trace[traceSeq % TRACESIZE];
+	bzero(sp, sizeof(*sp));
+	sp->id = traceSeq;
+	sp->kind = idle ? "discover" : traceKind;
+	sp->dev = buf[4];
+	sp->num = buf[5];
+	sp->cmd = buf[6];
+	sp->queued = monoNow();
+	return sp->id;
+}
+
+/***********/
+/* TRACERX */
+/***********/
+void traceRx(struct frame * fp) {
+	// The reply, or timeout, of a traced command. The bus thread's times come in the frame.
+	struct span * sp = &trace[fp->id % TRACESIZE];
+	traceCur = NULL;
+	if (fp->id == 0 || sp->id != fp->id) return;	// Unsolicited, or overwritten already
+	sp->sent = fp->sent;
+	sp->first = fp->count ? fp->rx : 0;
+	sp->complete = fp->done;
+	sp->bytes = fp->count;
+	traceCur = sp;
+}
+
+/*************/
+/* TRACEDONE */
+/*************/
+void traceDone(void) {
+	if (traceCur) traceCur->decoded = monoNow();
+	traceCur = NULL;
+}
+
+/*************/
+/* TRACEEMIT */
+/*************/
+void traceEmit(void) {
+	if (traceCur && !traceCur->emitted) traceCur->emitted = monoNow();
+}
+
+/***************/
+/* TRACEREPORT */
+/***************/
+void traceReport(int fd, char * cmd) {
+	// GetTrace [n]: the last n commands (default TRACEDEFAULT) as Chrome trace JSON, in one message.
+	// GetTrace file: all of them into TRACEFILE; the reply says where.
+	// Open in chrome://tracing or ui.perfetto.dev. Lanes are the wait for the pacing gap, the bus
+	// (command sent to reply complete), the main thread's decoding, and one per inverter showing
+	// its latency to the first byte. Times are microseconds since the epoch.
+	static char msg[TRACEMSG];
+	static const char * lane[] = {"", "queue", "bus", "decode"};
+	char ev[400], name[24], fname[64];
+	FILE * fp = NULL;
+	struct span * sp;
+	double off = realOffset();
+	unsigned int id, from;
+	int n = TRACEDEFAULT, len, i, events = 0;
+
+	cmd += 8;
+	while (*cmd == ' ') cmd++;
+	if (strcasecmp(cmd, "file") == 0) {
+		sprintf(fname, TRACEFILE, controllernum);
+		if ((fp = fopen(fname, "w")) == NULL) {
+			sprintf(msg, "trace error:%s file:%s", strerror(errno), fname);
+			sockSend(fd, msg);
+			return;
+		}
+		n = TRACESIZE;
+	} else if (*cmd && ((n = atoi(cmd)) < 1 || n > TRACESIZE))
+		n = TRACEDEFAULT;
+	from = traceSeq >= (unsigned) n ? traceSeq - n + 1 : 1;
+	len = sprintf(msg, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	if (fp) fputs(msg, fp);
+	for (i = 1; i <= 3 + MAXINVERTERS; i++) {		// Lane names
+		if (i > 3) sprintf(name, "inverter %d", i - 3);
+		sprintf(ev, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				i > 1 ? "," : "", controllernum, i, i > 3 ? name : lane[i]);
+		if (fp) fputs(ev, fp);
+		else len += sprintf(msg + len, "%s", ev);
+	}
+	for (id = from; id && id <= traceSeq; id++) {
+		sp = &trace[id % TRACESIZE];
+		if (sp->id != id) continue;
+		if (sp->cmd >= VARSTART && sp->cmd <= VAREND)
+			sprintf(name, "%s %d", valueName[sp->cmd - VARSTART], sp->num);
+		else
+			sprintf(name, "0x%02x %d/%d", sp->cmd, sp->dev, sp->num);
+		for (i = 1; i <= 4; i++) {
+			double start = 0, end = 0;
+			int tid = i;
+			switch (i) {
+				case 1: start = sp->queued; end = sp->sent; break;
+				case 2: start = sp->sent; end = sp->complete; break;
+				case 3: start = sp->complete; end = sp->decoded; break;
+				case 4: start = sp->sent; end = sp->first; tid = sp->dev == 1 && sp->num >= 1 && sp->num <= MAXINVERTERS ? 3 + sp->num : 0; break;
+			}
+			if (start == 0 || end == 0 || tid == 0) continue;
+			sprintf(ev, ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%d,"
+					"\"args\":{\"id\":%u,\"bytes\":%d%s}}",
+					name, sp->kind, (start + off) * 1e6, (end - start) * 1e6, controllernum, tid, sp->id, sp->bytes,
+					i == 2 && sp->bytes == 0 ? ",\"timeout\":1" : "");
+			if (fp) fputs(ev, fp);
+			else if (len + strlen(ev) + 40 < TRACEMSG) len += sprintf(msg + len, "%s", ev);
+			events++;
+		}
+		if (sp->emitted) {
+			sprintf(ev, ",{\"name\":\"emit\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.0f,\"pid\":%d,\"tid\":3}",
+					sp->kind, (sp->emitted + off) * 1e6, controllernum);
+			if (fp) fputs(ev, fp);
+			else if (len + strlen(ev) + 40 < TRACEMSG) len += sprintf(msg + len, "%s", ev);
+			events++;
+		}
+	}
+	if (fp) {
+		fputs("]}\n", fp);
+		fclose(fp);
+		sprintf(msg, "trace events:%d file:%s", events, fname);
+	} else
+		strcpy(msg + len, "]}");
+	sockSend(fd, msg);
+}
+
+/***************/
+/* THREADSTART */
+/***************/
+int threadStart(pthread_t * tid, void * (*fn)(void *), void * arg) {
+	// As pthread_create. None of the threads has deep calls or big locals
+	pthread_attr_t attr;
+	int err;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREADSTACK);
+	err = pthread_create(tid, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+/***********/
+/* TPFLOAT */
+/***********/
+int tpFloat(float f) {
+	// The bits of f, so a float goes in an int argument. %F prints it
+	union {float f; int i;} u;
+	u.f = f;
+	return u.i;
+}
+
+#ifndef TINY
+/************/
+/* TPRECORD */
+/************/
+void tpRecord(int sub, int id, int * arg, int n) {
+	// 1.62 Any thread, called by TP() only when the subsystem is on. The thread's own buffer, so no
+	// lock; the oldest record goes when it is full. A dump may be copying the record meanwhile,
+	// so seq is cleared first and set last.
+	struct tpbuf * bp = tpMine;
+	struct tprec * rp;
+	int i;
+	if (bp == NULL) {		// First from this thread
+		if (tpNone) return;
+		i = __sync_fetch_and_add(&tpThreads, 1);
+		if (i >= TPTHREADS || (bp = calloc(1, sizeof(*bp))) == NULL) {
+			tpNone = 1;
+			return;
+		}
+		strncpy(bp->name, tpName, sizeof(bp->name) - 1);
+		__sync_synchronize();
+		tpBuf[i] = tpMine = bp;
+	}
+	rp = &bp->rec[bp->seq & (TPRECS - 1)];
+	rp->seq = 0;
+	__sync_synchronize();
+	rp->id = id;
+	rp->sub = sub;
+	rp->t = monoNow();
+	for (i = 0; i < TPARGS; i++)
+		rp->arg[i] = i < n ? arg[i] : 0;
+	__sync_synchronize();
+	rp->seq = ++bp->seq;
+}
+
+/**********/
+/* TPDATA */
+/**********/
+void tpData(int sub, int id, unsigned char * p, int len) {
+	// Bytes, 16 to a record: the offset, the bytes in arg[1..4], how many in arg[5]
+	int a[TPARGS], off, n;
+	for (off = 0; off < len; off += 16) {
+		n = len - off < 16 ? len - off : 16;
+		bzero(a, sizeof(a));
+		a[0] = off;
+		memcpy(a + 1, p + off, n);
+		a[5] = n;
+		tpRecord(sub, id, a, TPARGS);
+	}
+}
+
+/***********/
+/* TPPARSE */
+/***********/
+int tpParse(char * list) {
+	// tx,rx,.. or all or off to a tpMask. -1 if a name isn't known
+	char copy[SOCKMSG + 1], * cp;
+	int mask = 0, i;
+	if (strcasecmp(list, "all") == 0) return TP_ALL;
+	if (strcasecmp(list, "off") == 0) return 0;
+	strncpy(copy, list, SOCKMSG);
+	copy[SOCKMSG] = '\0';
+	for (cp = strtok(copy, ", "); cp; cp = strtok(NULL, ", ")) {
+		for (i = 0; i < sizeof(tpSubName) / sizeof(tpSubName[0]); i++)
+			if (strcasecmp(cp, tpSubName[i]) == 0) break;
+		if (i == sizeof(tpSubName) / sizeof(tpSubName[0])) return -1;
+		mask |= 1 << i;
+	}
+	return mask;
+}
+
+/**********/
+/* TPDUMP */
+/**********/
+int tpDump(char * name) {
+	// Main thread. Every thread's records as they stand, in no particular order; fronius -T sorts
+	// them. One overwritten while it was copied has a different seq after, and is left out.
+	// Return the number written, -1 if the file can't be.
+	FILE * fp;
+	struct tphead h;
+	struct tpbuf * bp;
+	struct tprec r;
+	unsigned int seq;
+	int i, j, n = 0;
+	if ((fp = fopen(name, "w")) == NULL) return -1;
+	bzero(&h, sizeof(h));
+	h.magic = TPMAGIC;
+	h.version = 1;
+	h.recsize = sizeof(struct tprec);
+	h.controller = controllernum;
+	h.offset = realOffset();
+	for (i = 0; i < TPTHREADS; i++)
+		if (tpBuf[i]) strncpy(h.name[i], tpBuf[i]->name, sizeof(h.name[i]));
+	fwrite(&h, sizeof(h), 1, fp);
+	for (i = 0; i < TPTHREADS; i++) {
+		if ((bp = tpBuf[i]) == NULL) continue;
+		for (j = 0; j < TPRECS; j++) {
+			if ((seq = bp->rec[j].seq) == 0) continue;
+			__sync_synchronize();
+			memcpy(&r, (void *)&bp->rec[j], sizeof(r));
+			__sync_synchronize();
+			if (bp->rec[j].seq != seq) continue;
+			r.thread = i;
+			fwrite(&r, sizeof(r), 1, fp);
+			n++;
+		}
+	}
+	if (fclose(fp) != 0) return -1;
+	return n;
+}
+
+/*************/
+/* TPCOMPARE */
+/*************/
+int tpCompare(const void * a, const void * b) {
+	// qsort: by time, then as each thread wrote them
+	const struct tprec * ra = a, * rb = b;
+	if (ra->t != rb->t) return ra->t < rb->t ? -1 : 1;
+	if (ra->thread != rb->thread) return ra->thread - rb->thread;
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+/***********/
+/* TPPRINT */
+/***********/
+void tpPrint(struct tprec * rp) {
+	// The record's text from its format in fronius.dict, with %C %F %X and %S as described there
+	const char * f;
+	char spec[16];
+	unsigned char * b = (unsigned char *)(rp->arg + 1);
+	int a = 0, k, i, n = rp->arg[5] < 0 ? 0 : rp->arg[5] > 16 ? 16 : rp->arg[5];
+	union {int i; float f;} u;
+	if (rp->id >= DICT_TRACE || dictTraceFormat[rp->id] == NULL) {
+		printf("tracepoint %d", rp->id);
+		return;
+	}
+	printf("%-9s ", dictTraceName[rp->id]);
+	for (f = dictTraceFormat[rp->id]; *f; f++) {
+		if (*f != '%') {
+			putchar(*f);
+			continue;
+		}
+		for (k = 0, spec[k++] = *f++; *f && strchr("-+ #0123456789.", *f) && k < sizeof(spec) - 2; )
+			spec[k++] = *f++;
+		if (*f == '\0') break;
+		spec[k + 1] = '\0';
+		switch (spec[k] = *f) {
+			case '%': putchar('%'); break;
+			case 'X': for (i = 0; i < n; i++) printf(i ? " %02x" : "%02x", b[i]); break;
+			case 'S': for (i = 0; i < n; i++) putchar(b[i] >= ' ' && b[i] < 0x7f ? b[i] : '.'); break;
+			case 'C':
+				spec[k] = 's';
+				i = a < TPARGS ? rp->arg[a++] : 0;
+				printf(spec, i >= 0 && i < sizeof(CommandName) / sizeof(CommandName[0]) && CommandName[i] ? CommandName[i] : "?");
+				break;
+			case 'F':
+				spec[k] = 'f';
+				u.i = a < TPARGS ? rp->arg[a++] : 0;
+				printf(spec, (double) u.f);
+				break;
+			default:
+				printf(spec, a < TPARGS ? rp->arg[a++] : 0);
+		}
+	}
+}
+
+/************/
+/* TPDECODE */
+/************/
+int tpDecode(char * name) {
+	// fronius -T file: a dump in time order, one line per record: local time, mSec since the
+	// record before, thread, subsystem, tracepoint and its text. Works on any host; only the
+	// byte order and structure layout have to match the board it came from.
+	FILE * fp;
+	struct tphead h;
+	struct tprec * rec = NULL, * rp;
+	int n = 0, size = 0, i, sub;
+	double prev = 0;
+	time_t secs;
+	char when[16];
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != TPMAGIC || h.version != 1 || h.recsize != sizeof(struct tprec)) {
+		fprintf(stderr, "%s: not a tracepoint dump from this build\n", name);
+		fclose(fp);
+		return -1;
+	}
+	for (;;) {
+		if (n == size && (rp = realloc(rec, (size = size ? size * 2 : 1024) * sizeof(*rec))) != NULL)
+			rec = rp;
+		if (n == size || fread(rec + n, sizeof(*rec), 1, fp) != 1) break;
+		n++;
+	}
+	fclose(fp);
+	qsort(rec, n, sizeof(*rec), tpCompare);
+	printf("# %s: controller %d, %d records\n", name, h.controller, n);
+	for (i = 0; i < n; i++) {
+		rp = &rec[i];
+		secs = rp->t + h.offset;
+		strftime(when, sizeof(when), "%H:%M:%S", localtime(&secs));
+		for (sub = 0; sub < 4 && !(rp->sub & (1 << sub)); sub++) ;
+		printf("%s.%06d %9.3f %-4.8s %-6s ", when, (int)((rp->t + h.offset - secs) * 1e6),
+			   i ? (rp->t - prev) * 1000 : 0.0, rp->thread < TPTHREADS ? h.name[rp->thread] : "?", tpSubName[sub]);
+		tpPrint(rp);
+		putchar('\n');
+		prev = rp->t;
+	}
+	free(rec);
+	return n;
+}
+
+/************/
+/* TPREPORT */
+/************/
+void tpReport(int fd, char * cmd) {
+	// Tracepoints: which subsystems are on.  Tracepoints tx,rx,..|all|off: just those.
+	// Tracepoints dump: write them all to TPFILE for fronius -T.  The reply says what is on.
+	char buffer[200], name[64];
+	int mask, len, i, n;
+	cmd += 11;
+	while (*cmd == ' ') cmd++;
+	if (strcasecmp(cmd, "dump") == 0) {
+		sprintf(name, TPFILE, controllernum);
+		if ((n = tpDump(name)) < 0)
+			sprintf(buffer, "tracepoints error:%s file:%s", strerror(errno), name);
+		else
+			sprintf(buffer, "tracepoints file:%s records:%d", name, n);
+		sockSend(fd, buffer);
+		return;
+	}
+	if (*cmd) {
+		if ((mask = tpParse(cmd)) < 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d Tracepoints: not all of '%s' are tx,rx,decode,sanity,socket", controllernum, cmd);
+			logmsg(WARN, buffer);
+			return;
+		}
+		tpMask = mask;
+	}
+	len = sprintf(buffer, "tracepoints");
+	for (i = 0; i < sizeof(tpSubName) / sizeof(tpSubName[0]); i++)
+		if (tpMask & (1 << i)) len += sprintf(buffer + len, " %s", tpSubName[i]);
+	if (tpMask == 0) len += sprintf(buffer + len, " off");
+	for (i = n = 0; i < TPTHREADS; i++)
+		if (tpBuf[i]) n += tpBuf[i]->seq < TPRECS ? tpBuf[i]->seq : TPRECS;
+	sprintf(buffer + len, " threads:%d records:%d", tpThreads < TPTHREADS ? tpThreads : TPTHREADS, n);
+	sockSend(fd, buffer);
+}
+#endif
+
+#ifdef TINY
+/**********/
+/* FMTSTR */
+/**********/
+// 1.59 Enough formatting for the records, so printf's floating point isn't on the hot path.
+// The callers know the buffer is big enough, as they did with sprintf.
+char * fmtStr(char * p, const char * s) {
+	while (*s) *p++ = *s++;
+	*p = '\0';
+	return p;
+}
+
+/**********/
+/* FMTINT */
+/**********/
+char * fmtInt(char * p, long n) {
+	char digits[24];
+	int i = 0;
+	unsigned long u = n < 0 ? -(unsigned long) n : n;
+	if (n < 0) *p++ = '-';
+	do digits[i++] = '0' + u % 10;
+	while ((u /= 10));
+	while (i) *p++ = digits[--i];
+	*p = '\0';
+	return p;
+}
+
+/************/
+/* FMTFIXED */
+/************/
+char * fmtFixed(char * p, double v, int dp) {
+	// Rounded as printf does: to nearest, an exact tie to even. Where v * 10^dp itself rounded
+	// to a half, fma() says which side of it v really was.
+	static const double scale[] = {1, 10, 100, 1000};
+	unsigned long long u;
+	double x, r;
+	int i;
+	if (v != v) return fmtStr(p, "nan");
+	if (v < 0) {
+		*p++ = '-';
+		v = -v;
+	}
+	if (v >= 1e15) dp = 0;		// No room for the fraction; it is noise at this size anyway
+	x = v * scale[dp];
+	u = x;
+	if (x - u > 0.5 || (x - u == 0.5 && ((r = fma(v, scale[dp], -x)) > 0 || (r == 0 && (u & 1))))) u++;
+	p = fmtInt(p, u / (unsigned long long) scale[dp]);
+	if (dp) {
+		*p++ = '.';
+		u %= (unsigned long long) scale[dp];
+		for (i = dp - 1; i >= 0; i--) {
+			p[i] = '0' + u % 10;
+			u /= 10;
+		}
+		p += dp;
+		*p = '\0';
+	}
+	return p;
+}
+
+/***********/
+/* FMTDATA */
+/***********/
+char * fmtData(char * p, int invnum) {
+	// The data line as sprintf makes it in processPacket
+	static const char * oldName[] = {"data 9 ", " ", " ", " ", " ", " ", " ", " ", " "};
+	static const int oldDp[] = {0, 0, 0, 0, 2, 1, 2, 3, 1};
+	static const char * newName[] = {"inverter watts:", " kwh:", " iac:", " vac:", " hz:", " idc:", " vdc:"};
+	static const int newVal[] = {0, 1, 4, 5, 6, 7, 8};
+	static const int newDp[] = {0, 1, 2, 1, 3, 2, 1};
+	float * valp = responseVal[invnum - 1];
+	int i;
+	if (dataFormat == old) {
+		for (i = 0; i < VAREND - VARSTART + 1; i++)
+			p = fmtFixed(fmtStr(p, oldName[i]), valp[i], oldDp[i]);
+		return p;
+	}
+	for (i = 0; i < 7; i++)
+		p = fmtFixed(fmtStr(p, newName[i]), newVal[i] == 1 ? valp[1] / 1000.0 : valp[newVal[i]], newDp[i]);
+	p = fmtFixed(fmtStr(p, " wh:"), energy[invnum - 1].wh, 0);
+	return fmtFixed(fmtStr(p, " ts:"), sampleTime[invnum - 1][0], 3);
+}
+#endif
+
+/****************/
+/* ENERGYUPDATE */
+/****************/
+void energyUpdate(int invnum, int i, int exp) {
+	// Energy Total only moves in steps of 10^exp Wh (1kWh by default) and is polled once a sweep.
+	// Between readings, integrate power (trapezium rule) to get Wh. The true total is somewhere in
+	// [counter, counter + step), so the estimate is raised to the counter when it falls behind and
+	// held at counter + step when it runs ahead, until the counter moves. It never goes back:
+	// wh: is cumulative and a fall would be negative energy to whoever takes differences.
+	double t = sampleTime[invnum - 1][i];
+	float value = responseVal[invnum - 1][i];
+	struct integral * ep = &energy[invnum - 1];
+	double inc, ceiling;
+	if (i == 0x10 - VARSTART) {		// Power now
+		if (ep->wh > 0 && ep->lastT > 0 && t - ep->lastT < MAXGAP) {
+			inc = (ep->lastW + value) / 2.0 * (t - ep->lastT) / 3600.0;
+			ceiling = ep->counter + ep->step;
+			if (ep->counter > 0 && ep->wh + inc > ceiling)
+				inc = ceiling > ep->wh ? ceiling - ep->wh : 0;
+			ep->wh += inc;
+		}
+		ep->lastT = t;
+		ep->lastW = value;
+	}
+	if (i == 0x11 - VARSTART && value > 0 && value != ep->counter) {	// Fresh Energy Total
+		if (ep->wh < value)
+			ep->wh = value;
+		TP(TP_DECODE, tpEnergy, invnum, tpFloat(ep->counter), tpFloat(value), tpFloat(ep->wh));
+		ep->counter = value;
+		ep->step = tentothe(exp);
+	}
+}
+
+/****************/
+/* ROLLUPUPDATE */
+/****************/
+void rollupUpdate(int invnum, int i) {
+	// Fixed size: each window has the bucket being filled and the last one completed.
+	// 1 and 15 minute buckets start on the clock; daily buckets at local midnight.
+	time_t t = sampleTime[invnum - 1][i];
+	float value = responseVal[invnum - 1][i];
+	struct rollup * rp = rollup[invnum - 1][i];
+	int w;
+	for (w = 0; w < NUMWINDOWS; w++, rp++) {
+		rollupRotate(rp, rollupStart(w, t));
+		if (rp->cur.count == 0)
+			rp->cur.min = rp->cur.max = value;
+		rp->cur.sum += value;
+		if (value < rp->cur.min) rp->cur.min = value;
+		if (value > rp->cur.max) rp->cur.max = value;
+		rp->cur.count++;
+	}
+}
+
+/**************/
+/* ROLLUPTICK */
+/**************/
+void rollupTick(time_t now) {
+	// Called from the main loop. Intervals end on the clock whether or not a sample comes, so
+	// at night GetRollup gives the empty interval just gone, not the last one that had data.
+	static time_t last = 0;
+	int inv, i, w;
+	if (now / 60 == last / 60) return;
+	last = now;
+	for (inv = 0; inv < MAXINVERTERS; inv++)
+		for (i = 0; i < VAREND - VARSTART + 1; i++)
+			for (w = 0; w < NUMWINDOWS; w++)
+				if (rollup[inv][i][w].cur.start)	// Nothing to close until it has had a sample
+					rollupRotate(&rollup[inv][i][w], rollupStart(w, now));
+}
+
+/***************/
+/* ROLLUPSTART */
+/***************/
+time_t rollupStart(int w, time_t t) {
+	// Start of the window w interval holding t
+	static time_t dayStart = 0, dayEnd = 0;		// local midnights either side of t
+	struct tm tm;
+	if (windowLen[w] != 86400)
+		return t - t % windowLen[w];
+	if (t < dayStart || t >= dayEnd) {	// 1.54 localtime() once a day, not for every value
+		tm = *localtime(&t);
+		dayStart = t - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+		tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		tm.tm_mday++;
+		tm.tm_isdst = -1;		// tomorrow may be 23 or 25 hours away
+		dayEnd = mktime(&tm);
+	}
+	return dayStart;
+}
+
+/****************/
+/* ROLLUPROTATE */
+/****************/
+void rollupRotate(struct rollup * rp, time_t start) {
+	// Start a new interval if start is after the current one. Empty intervals are kept as such.
+	// Never back: a sample read just before the minute may be handled just after it.
+	if (start <= rp->cur.start) return;
+	if (rp->cur.start) rp->prev = rp->cur;
+	rp->cur.start = start;
+	rp->cur.sum = 0;
+	rp->cur.min = rp->cur.max = 0;
+	rp->cur.count = 0;
+}
+
+/****************/
+/* ROLLUPREPORT */
+/****************/
+void rollupReport(int fd, char * cmd) {
+	// GetRollup [n] 1m|15m|day [current]
+	// One line per inverter: rollup inv:n window:15m start:t count:c watts:mean/min/max ...
+	// Default is the last complete interval; 'current' gives the one being filled.
+	char buffer[512], buf2[64];
+	char arg1[16] = "", arg2[16] = "", arg3[16] = "";
+	char * win, * opt;
+	int from = 1, to = MAXINVERTERS, inv, i, w, n = 0;
+	struct bucket * bp;
+	
+	sscanf(cmd + 9, "%15s %15s %15s", arg1, arg2, arg3);
+	if (sscanf(arg1, "%d%n", &inv, &n) == 1 && arg1[n] == '\0') {	// Not the 1 of 1m
+		from = to = inv;
+		win = arg2; opt = arg3;
+	} else {
+		win = arg1; opt = arg2;
+	}
+	for (w = 0; w < NUMWINDOWS; w++)
+		if (strcasecmp(win, windowName[w]) == 0) break;
+	if (w == NUMWINDOWS || from < 1 || to > MAXINVERTERS) {
+		sprintf(buffer, "WARN " PROGNAME " %d GetRollup: expected [1-%d] 1m|15m|day [current]", controllernum, MAXINVERTERS);
+		logmsg(WARN, buffer);
+		return;
+	}
+	for (inv = from; inv <= to; inv++) {
+		if (from != to && (inv >= 32 || !(inverterStatus & (1 << inv)))) continue;
+		bp = strcasecmp(opt, "current") == 0 ? &rollup[inv - 1][0][w].cur : &rollup[inv - 1][0][w].prev;
+		sprintf(buffer, "rollup inv:%d window:%s start:%ld count:%d", inv, windowName[w], (long)bp->start, bp->count);
+		for (i = 0; i < VAREND - VARSTART + 1; i++) {
+			bp = strcasecmp(opt, "current") == 0 ? &rollup[inv - 1][i][w].cur : &rollup[inv - 1][i][w].prev;
+			if (bp->count)
+				sprintf(buf2, " %s:%.3f/%.3f/%.3f", valueName[i], bp->sum / bp->count, bp->min, bp->max);
+			else
+				sprintf(buf2, " %s:-", valueName[i]);
+			strcat(buffer, buf2);
+		}
+		sockSend(fd, buffer);
+	}
+}
+
+/***********/
+/* SHMOPEN */
+/***********/
+void shmOpen(void) {
+	// Create and map the snapshot. Failure is not fatal - local readers just won't find it.
+	char name[64];
+	int fd;
+	sprintf(name, FRONIUS_SHMNAME, controllernum);
+	if ((fd = open(name, O_RDWR | O_CREAT, 0644)) < 0 || ftruncate(fd, sizeof(struct fronius_shm)) < 0) {
+		sprintf(buffer, "WARN " PROGNAME " %d Can't create shared memory %s: %s", controllernum, name, strerror(errno));
+		logmsg(WARN, buffer);
+		if (fd >= 0) close(fd);
+		return;
+	}
+	shm = mmap(NULL, sizeof(struct fronius_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);		// the mapping holds its own reference
+	if (shm == MAP_FAILED) {
+		sprintf(buffer, "WARN " PROGNAME " %d Can't map shared memory %s: %s", controllernum, name, strerror(errno));
+		logmsg(WARN, buffer);
+		shm = NULL;
+		return;
+	}
+	shm->magic = 0;		// Readers ignore it while we initialise
+	__sync_synchronize();
+	bzero(shm, sizeof(struct fronius_shm));
+	shm->seq = 1;
+	shm->version = FRONIUS_VERSION;
+	shm->size = sizeof(struct fronius_shm);
+	shm->controller = controllernum;
+	shm->pid = getpid();
+	shm->magic = FRONIUS_MAGIC;
+	__sync_synchronize();
+	shm->seq = 2;
+}
+
+/**************/
+/* SHMPUBLISH */
+/**************/
+void shmPublish(int invnum) {
+	// Copy the current state of one inverter into the snapshot under the seqlock.
+	struct fronius_inverter * ip;
+	int i;
+	if (shm == NULL) return;
+	shm->seq++;			// odd: write in progress
+	__sync_synchronize();
+	shm->activeMask = inverterStatus;
+	shm->numInverters = numInverters;
+	shm->updated = timeNow();
+	if (invnum >= 1 && invnum <= MAXINVERTERS) {
+		ip = &shm->inv[invnum - 1];
+		for (i = 0; i < VAREND - VARSTART + 1; i++) {
+			ip->value[i] = responseVal[invnum - 1][i];
+			ip->updated[i] = sampleTime[invnum - 1][i];
+		}
+		ip->devType = devType[invnum - 1];
+		ip->ratedPower = devType[invnum - 1] ? ratedPower(devType[invnum - 1]) : 0;
+		for (i = 0; i < MAXFAULTS; i++) {
+			ip->fault[i].code = activeFault[invnum - 1][i].code;
+			ip->fault[i].count = activeFault[invnum - 1][i].count;
+			ip->fault[i].first = activeFault[invnum - 1][i].first;
+			ip->fault[i].last = activeFault[invnum - 1][i].last;
+		}
+	}
+	__sync_synchronize();
+	shm->seq++;			// even: consistent
+}
+
+/***********/
+/* TIMENOW */
+/***********/
+double timeNow(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/***********/
+/* MONONOW */
+/***********/
+double monoNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/**************/
+/* REALOFFSET */
+/**************/
+double realOffset(void) {
+	// Main thread. Monotonic time doesn't jump when the clock is set, so frames are stamped with it
+	// and turned into real time here. The offset is taken again every minute to follow the clock.
+	static double offset = 0, taken = -60;
+	double mono = monoNow();
+	if (mono - taken >= 60) {
+		offset = timeNow() - mono;
+		taken = mono;
+	}
+	return offset;
+}
+
+/***********/
+/* RINGPUT */
+/***********/
+int ringPut(struct ring * r, void * item) {
+	// Producer side. Returns 0 if full.
+	unsigned int head = r->head;
+	if (head - r->tail == (unsigned int)r->size) return 0;
+	memcpy(r->slots + (head & (r->size - 1)) * r->itemsize, item, r->itemsize);
+	__sync_synchronize();		// slot contents visible before the index moves
+	r->head = head + 1;
+	return 1;
+}
+
+/***********/
+/* RINGGET */
+/***********/
+int ringGet(struct ring * r, void * item) {
+	// Consumer side. Returns 0 if empty.
+	unsigned int tail = r->tail;
+	if (r->head == tail) return 0;
+	__sync_synchronize();
+	memcpy(item, r->slots + (tail & (r->size - 1)) * r->itemsize, r->itemsize);
+	__sync_synchronize();		// finished with the slot before handing it back
+	r->tail = tail + 1;
+	return 1;
+}
+
+/************/
+/* BUSSTART */
+/************/
+void busStart(int commfd) {
+	static int fd;
+	fd = commfd;
+	if (pipe(busPipe) < 0 || pipe(wakePipe) < 0) {
+		sprintf(buffer, "FATAL " PROGNAME " %d Can't create pipes for bus thread: %s", controllernum, strerror(errno));
+		logmsg(FATAL, buffer);
+	}
+	// A full pipe already means a wakeup is pending, so writers never need to block
+	fcntl(busPipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(busPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+	if (threadStart(&busTid, busThread, &fd) != 0) {
+		sprintf(buffer, "FATAL " PROGNAME " %d Can't start bus thread", controllernum);
+		logmsg(FATAL, buffer);
+	}
+	busRunning = 1;
+}
+
+/***********/
+/* BUSSTOP */
+/***********/
+void busStop(void) {
+	if (!busRunning) return;
+	busQuit = 1;
+	write(wakePipe[1], "q", 1);
+	pthread_join(busTid, NULL);
+	busRunning = 0;
+	busLogDrain();
+}
+
+/*************/
+/* BUSSUBMIT */
+/*************/
+int busSubmit(unsigned char * buf, int len, int pace, int idle) {
+	// Main thread: hand a complete frame to the bus thread. Return 1 for a logged failure.
+	// Pace is the mSec gap before it goes, -1 = paceTime(); idle marks a discovery query.
+	struct frame f;
+	if (!busRunning) return 0;		// fake data
+	f.count = len;
+	f.reply = 1;
+	f.pace = pace;
+	f.idle = idle;
+	f.id = traceBegin(buf, idle);
+	memcpy(f.buf, buf, len);
+	if (!ringPut(&txRing, &f)) {
+		sprintf(buffer, "WARN " PROGNAME " %d Bus transmit queue full - command dropped", controllernum);
+		logmsg(WARN, buffer);
+		return 1;
+	}
+	write(wakePipe[1], "w", 1);
+	return 0;
+}
+
+/**********/
+/* BUSLOG */
+/**********/
+void busLog(int severity, char * msg) {
+	// logmsg writes to the logfile and server socket which belong to the main thread
+	struct logline l;
+	if (!busRunning || !pthread_equal(pthread_self(), busTid)) {	// Before the thread starts
+		logmsg(severity, msg);
+		return;
+	}
+	l.severity = severity;
+	strncpy(l.text, msg, sizeof(l.text) - 1);
+	l.text[sizeof(l.text) - 1] = '\0';
+	if (!ringPut(&logRing, &l))
+		fprintf(stderr, "Bus log full, lost: %s\n", msg);
+	write(busPipe[1], "l", 1);
+}
+
+/**********/
+/* BUSPUT */
+/**********/
+int busPut(struct frame * fp) {
+	// Bus thread: pass a frame to main. Return 0 if the ring is full and it is lost, which is
+	// counted and logged. A lost reply is the caller's to turn into a timeout.
+	char msg[100];
+	if (ringPut(&rxRing, fp)) return 1;
+	if (rxDropped++ % 100 == 0) {		// Not a message for each while main is stuck
+		sprintf(msg, "WARN " PROGNAME " %d Bus receive queue full - %d frames lost", controllernum, rxDropped);
+		busLog(WARN, msg);
+	}
+	return 0;
+}
+
+/***************/
+/* BUSLOGDRAIN */
+/***************/
+void busLogDrain(void) {
+	struct logline l;
+	while (ringGet(&logRing, &l))
+		logmsg(l.severity, l.text);
+}
+
+/*************/
+/* BUSTIMING */
+/*************/
+void busTiming(struct frame * fp) {
+	// Bus thread. What main needs of the timing goes with each frame, so latency[] stays ours.
+	fp->target = rttTarget;
+	fp->rtt = latency[rttTarget].samples ? latency[rttTarget].srtt + 4 * latency[rttTarget].rttvar + 1 : 0;
+	fp->gap = paceTime(waittime);
+}
+
+/*************/
+/* BUSTHREAD */
+/*************/
+void * busThread(void * arg) {
+	// Owns commfd. Sends one command at a time, paced as paceTime() says, and passes every frame
+	// received to the main thread marked as the reply or not. If no reply comes within
+	// replyTimeout() an empty frame says so. Error messages are never taken as the reply.
+	int commfd = *(int *)arg;
+	int awaiting = 0;			// a command is out and its reply not yet seen
+	int idle = 0;				// .. and it is a discovery query
+	struct timeval lastDone;	// when the last reply came or timed out
+	struct frame f, tx;
+	struct data rx;
+	int havetx = 0;				// tx holds a command waiting for its gap to pass
+	fd_set readfd;
+	struct timeval timeout;
+	int left, nfds, i, len, since;
+	char drain[RINGSIZE];
+	double first, done;
+	unsigned int txId = 0;		// trace span of the command out
+	double txSent = 0;
+	struct frame lost;			// a timeout standing in for a reply the full ring lost
+	int lostReply = 0;			// .. still to be passed on
+	
+	gettimeofday(&lastDone, NULL);
+	lastDone.tv_sec -= 3600;	// nothing to wait for at first
+	tpName = "bus";
+	nfds = (commfd > wakePipe[0] ? commfd : wakePipe[0]) + 1;
+	while (!busQuit) {
+		if (lostReply && ringPut(&rxRing, &lost)) {
+			lostReply = 0;
+			write(busPipe[1], "t", 1);
+		}
+		if (!havetx && !awaiting) havetx = ringGet(&txRing, &tx);
+		// How long may we sleep?
+		left = 1000;
+		if (awaiting)
+			left = replyTimeout() - msSince(&frameSent);
+		else if (havetx)	// 1.50 the gap is chosen by the command about to go
+			left = (tx.pace >= 0 ? tx.pace : paceTime(waittime)) - msSince(&lastDone);
+		if (lostReply && left > MINPACE) left = MINPACE;	// Try again when main has made room
+		if (left < 0) left = 0;
+		timeout.tv_sec = left / 1000;
+		timeout.tv_usec = (left % 1000) * 1000;
+		FD_ZERO(&readfd);
+		FD_SET(commfd, &readfd);
+		FD_SET(wakePipe[0], &readfd);
+		if (select(nfds, &readfd, NULL, NULL, &timeout) < 0) {
+			if (errno != EINTR) usleep(10000);
+			continue;
+		}
+		if (FD_ISSET(wakePipe[0], &readfd))
+			read(wakePipe[0], drain, sizeof(drain));
+		if (FD_ISSET(commfd, &readfd)) {
+			first = monoNow();		// 1.55 the first byte, not the end of the burst
+			since = msSince(&frameSent);
+			rx.count = 0;
+			bzero(rx.buf, sizeof(rx.buf));
+			getbuf(commfd, &rx, sizeof(rx.buf), frameTimeout());	// V1.38 - was fixed 100mSec for serial extender
+			done = monoNow();
+			// A burst may hold more than one frame. Split on the length byte while it makes sense.
+			for (i = 0; i < rx.count; i += len) {
+				len = frameLength(rx.buf + i, rx.count - i);
+				f.rx = first + i * charTime() / 1000.0;		// later frames arrived later
+				bzero(f.buf, sizeof(f.buf));
+				memcpy(f.buf, rx.buf + i, len);
+				f.count = len;
+				f.reply = 0;
+				f.id = 0;
+				busTiming(&f);
+				// Garbage ahead of a frame in the same burst is not the reply; the frame is
+				if (awaiting && !(len >= 7 && f.buf[6] == ERRORSTATE)
+					&& !(i + len < rx.count && !(len >= 3 && f.buf[0] == 0x80 && f.buf[1] == 0x80 && f.buf[2] == 0x80))) {
+					f.reply = idle ? 2 : 1;
+					f.id = txId;
+					f.sent = txSent;
+					f.done = done;
+					measureRtt(since + i * charTime());
+					awaiting = 0;
+					if (!idle) gettimeofday(&lastDone, NULL);
+				}
+				if (!busPut(&f) && f.reply) {		// Main must still hear that the command is done
+					lost = f;
+					lost.count = 0;
+					lost.rx = 0;
+					lostReply = 1;
+				}
+			}
+			write(busPipe[1], "r", 1);
+		}
+		if (awaiting && msSince(&frameSent) >= replyTimeout()) {
+			TP(TP_RX, tpTimeout, replyTimeout());
+			rttPending = 0;
+			awaiting = 0;
+			f.count = 0;
+			f.reply = idle ? 2 : 1;
+			f.id = txId;
+			f.sent = txSent;
+			f.rx = 0;
+			f.done = monoNow();
+			busTiming(&f);
+			if (busPut(&f))
+				write(busPipe[1], "t", 1);
+			else {
+				lost = f;
+				lostReply = 1;
+			}
+			if (!idle) gettimeofday(&lastDone, NULL);
+		}
+		if (havetx && !awaiting && !lostReply && msSince(&lastDone) >= (tx.pace >= 0 ? tx.pace : paceTime(waittime))) {
+			havetx = 0;
+			idle = tx.idle;
+			txId = tx.id;
+			txSent = monoNow();
+			if (sendFrame(commfd, tx.buf, tx.count) == 0)
+				awaiting = tx.reply;
+			else {			// Couldn't send: tell main as if it timed out
+				f.count = 0;
+				f.reply = idle ? 2 : 1;
+				f.id = txId;
+				f.sent = f.rx = 0;
+				f.done = monoNow();
+				busTiming(&f);
+				if (busPut(&f))
+					write(busPipe[1], "t", 1);
+				else {
+					lost = f;
+					lostReply = 1;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/**************/
+/* BROKEROPEN */
+/**************/
+void brokerOpen(void) {
+	// 1.56 We keep the device to ourselves, as the flock says, and lend it out through a local
+	// socket. A client writes raw frames and reads back the reply to each. A reply that doesn't
+	// come is silence, as it would be on the bus itself, so tools written for the port work as is.
+	struct sockaddr_un addr;
+	int i;
+	for (i = 0; i < MAXCLIENTS; i++)
+		client[i].fd = -1;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), BROKERSOCK, controllernum);
+	unlink(addr.sun_path);		// Left by a previous run. We hold the lock, so it isn't in use
+	if ((brokerFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+		|| bind(brokerFd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		|| listen(brokerFd, MAXCLIENTS) < 0) {
+		sprintf(buffer, "WARN " PROGNAME " %d No bus broker on %s: %s", controllernum, addr.sun_path, strerror(errno));
+		logmsg(WARN, buffer);
+		if (brokerFd >= 0) close(brokerFd);
+		brokerFd = -1;
+		return;
+	}
+	fcntl(brokerFd, F_SETFL, O_NONBLOCK);
+}
+
+/***************/
+/* BROKERCLOSE */
+/***************/
+void brokerClose(void) {
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int i;
+	if (brokerFd < 0) return;
+	for (i = 0; i < MAXCLIENTS; i++)
+		if (client[i].fd >= 0) brokerDrop(i, "closed at shutdown");
+	close(brokerFd);
+	brokerFd = -1;
+	snprintf(path, sizeof(path), BROKERSOCK, controllernum);
+	unlink(path);
+}
+
+/*************/
+/* BROKERFDS */
+/*************/
+int brokerFds(fd_set * fds, int nfds) {
+	// Return nfds for select. A client with a full queue isn't read, so it blocks on write
+	int i;
+	if (brokerFd < 0) return nfds;
+	FD_SET(brokerFd, fds);
+	if (brokerFd >= nfds) nfds = brokerFd + 1;
+	for (i = 0; i < MAXCLIENTS; i++)
+		if (client[i].fd >= 0 && client[i].tail - client[i].head < CLIENTQUEUE) {
+			FD_SET(client[i].fd, fds);
+			if (client[i].fd >= nfds) nfds = client[i].fd + 1;
+		}
+	return nfds;
+}
+
+/**************/
+/* BROKERPOLL */
+/**************/
+void brokerPoll(fd_set * fds) {
+	int i, fd;
+	if (brokerFd < 0) return;
+	for (i = 0; i < MAXCLIENTS; i++)
+		if (client[i].fd >= 0 && FD_ISSET(client[i].fd, fds))
+			brokerRead(i);
+	if (!FD_ISSET(brokerFd, fds) || (fd = accept(brokerFd, NULL, NULL)) < 0) return;
+	for (i = 0; i < MAXCLIENTS && client[i].fd >= 0; i++) ;
+	if (i == MAXCLIENTS) {
+		sprintf(buffer, "WARN " PROGNAME " %d Bus broker: %d clients already, another refused", controllernum, MAXCLIENTS);
+		logmsg(WARN, buffer);
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	bzero(&client[i], sizeof(client[i]));
+	client[i].fd = fd;
+	sprintf(buffer, "INFO " PROGNAME " %d Bus broker: client %d connected", controllernum, i);
+	logmsg(INFO, buffer);
+}
+
+/**************/
+/* BROKERREAD */
+/**************/
+void brokerRead(int n) {
+	struct client * cp = &client[n];
+	int num;
+	if (cp->have == sizeof(cp->buf)) return;	// Queue full; brokerParse makes room
+	num = read(cp->fd, cp->buf + cp->have, sizeof(cp->buf) - cp->have);
+	if (num <= 0) {
+		if (num < 0 && (errno == EINTR || errno == EAGAIN)) return;
+		brokerDrop(n, num == 0 ? "closed" : strerror(errno));
+		return;
+	}
+	cp->have += num;
+	brokerParse(n);
+}
+
+/***************/
+/* BROKERPARSE */
+/***************/
+void brokerParse(int n) {
+	// Frames are found as on the bus: 80 80 80 then the length the header gives. Bytes that
+	// can't start a frame, and frames with a bad checksum, are dropped here, not sent.
+	struct client * cp = &client[n];
+	int len, i, sum, skip;
+	while (cp->have > 0 && cp->tail - cp->head < CLIENTQUEUE) {
+		for (i = 0; i < 3 && i < cp->have && cp->buf[i] == 0x80; i++) ;
+		if (i < 3 && i < cp->have) skip = 1;			// Not a header
+		else if (cp->have < 4) break;					// .. may be one
+		else if ((len = cp->buf[3] + 8) > BUFSIZE) skip = 1;	// too long for any command
+		else if (cp->have < len) break;
+		else {
+			for (sum = 0, i = 3; i < len - 1; i++)
+				sum += cp->buf[i];
+			if ((sum & 0xFF) == cp->buf[len - 1]) {
+				memcpy(cp->q[cp->tail % CLIENTQUEUE], cp->buf, len);
+				cp->qlen[cp->tail % CLIENTQUEUE] = len;
+				cp->tail++;
+			} else {
+				cp->dropped++;
+				TP(TP_SOCKET, tpBroker, n, cp->buf[len - 1], sum & 0xFF);
+			}
+			skip = len;
+		}
+		cp->have -= skip;
+		memmove(cp->buf, cp->buf + skip, cp->have);
+	}
+}
+
+/**************/
+/* BROKERSEND */
+/**************/
+int brokerSend(void) {
+	// Main thread, between commands. After each of ours one client frame may go, the clients
+	// taking it in turn, so no client holds up data collection or shuts out the others.
+	// Return 1 if a frame went and its reply is awaited.
+	struct client * cp;
+	int i, n;
+	if (brokerFd < 0 || !brokerTurn) return 0;
+	for (i = 0; i < MAXCLIENTS; i++) {
+		n = (brokerNext + i) % MAXCLIENTS;
+		cp = &client[n];
+		if (cp->fd < 0 || cp->head == cp->tail) continue;
+		brokerNext = (n + 1) % MAXCLIENTS;
+		brokerTurn = 0;
+		TP(TP_TX, tpClient, n, cp->qlen[cp->head % CLIENTQUEUE]);
+		traceKind = "client";		// A client frame waits the ordinary gap, even in a Batch
+		brokerBusy = !busSubmit(cp->q[cp->head % CLIENTQUEUE], cp->qlen[cp->head % CLIENTQUEUE], -1, 0);
+		traceKind = "poll";
+		cp->head++;
+		cp->sent++;
+		brokerParse(n);		// Room for any it sent while its queue was full
+		brokerClient = n;
+		return brokerBusy;
+	}
+	return 0;
+}
+
+/***************/
+/* BROKERREPLY */
+/***************/
+void brokerReply(struct frame * fp) {
+	struct client * cp;
+	brokerBusy = 0;
+	if (brokerClient < 0) return;		// It has gone
+	cp = &client[brokerClient];
+	if (fp->count == 0) {
+		cp->timeouts++;
+		return;
+	}
+	cp->replies++;
+	if (write(cp->fd, fp->buf, fp->count) != fp->count)
+		brokerDrop(brokerClient, "not reading its replies");
+}
+
+/**************/
+/* BROKERDROP */
+/**************/
+void brokerDrop(int n, char * why) {
+	struct client * cp = &client[n];
+	sprintf(buffer, "INFO " PROGNAME " %d Bus broker: client %d %s. Sent %d frames, %d replies, %d timeouts, %d bad",
+			controllernum, n, why, cp->sent, cp->replies, cp->timeouts, cp->dropped);
+	logmsg(INFO, buffer);
+	close(cp->fd);
+	cp->fd = -1;
+	if (brokerClient == n) brokerClient = -1;
+}
+
+/***************/
+/* FRAMELENGTH */
+/***************/
+int frameLength(unsigned char * buf, int avail) {
+	// A burst may hold more than one frame. A frame whose length byte fits in what is left and
+	// whose checksum is right is taken whole. Anything else - garbage, or a frame cut short - runs
+	// up to the next 80 80 80, so it doesn't take the good frames behind it down too.
+	int i, sum = 0;
+	if (avail >= 8 && buf[0] == 0x80 && buf[1] == 0x80 && buf[2] == 0x80 && buf[3] + 8 <= avail) {
+		for (i = 3; i < buf[3] + 7; i++)
+			sum += buf[i];
+		if ((sum & 0xFF) == buf[buf[3] + 7]) return buf[3] + 8;
+	}
+	for (i = 1; i + 2 < avail; i++)
+		if (buf[i] == 0x80 && buf[i + 1] == 0x80 && buf[i + 2] == 0x80) return i;
+	return avail;
+}
+
+/**********/
+/* GETBUF */
+/**********/
+int getbuf(int fd, struct data * dp, int max, int mSec) {
+	// Read up to max chars into supplied buf. Return number
+	// of chars read or negative error code if applicable
+	// 1.47 - into the caller's buffer; called from the bus thread
+	
+	int ready, numtoread, now;
+	fd_set readfd; 
+	struct timeval timeout;
+	FD_ZERO(&readfd);
+	// numread = 0;
+	numtoread = max;
+	
+	while(1) {
+		FD_SET(fd, &readfd);
+		timeout.tv_sec = mSec / 1000;
+		timeout.tv_usec = (mSec * 1000) % 1000000;	 // 0.5sec
+		ready = select(fd + 1, &readfd, NULL, NULL, &timeout);
+		if (ready == 0) {
+			TP(TP_RX, tpBurst, dp->count, mSec);
+			return dp->count;		// timed out - return what we've got
+		}
+		now = read(fd, dp->buf + dp->count, numtoread);	// 1.38 - take whatever has arrived, not one byte
+		TP(TP_RX, tpRead, now, dp->count);		// 1.62 each read as it comes, no longer a fprintf per byte
+		if (now > 0) TPDATA(TP_RX, tpRxData, dp->buf + dp->count, now);
+		if (now < 0)
+			return now;
+		if (now == 0) {
+			fprintf(stderr, "ERROR fd was ready but got no data\n");
+			if (reopenComm(fd) < 0) return -1;
+			//			usleep(1000000); // 1 Sec
+			continue;
+		}
+		// For Elster don't care if SYNC byte found in middle of data
+		/*		if (dp->buf[dp->count] == STARTSYNC && dp->count != 0) {
+		 sprintf(buffer, "WARN " PROGNAME " got 0x01 at position %d in packet", dp->count);
+		 logmsg(WARN, buffer);
+		 return -1;
+		 }
+		 if (dp->buf[dp->count] == STARTSYNC)
+		 return 0;
+		 */		
+		dp->count += now;
+		numtoread -= now;
+		if (numtoread == 0) return dp->count;
+		if (numtoread < 0) {	// CANT HAPPEN
+			fprintf(stderr, "ERROR buffer overflow - increase max from %d (numtoread = %d numread = %d)\n", 
+					max, numtoread, dp->count);
+			return dp->count;
+			
+		}
+	}
+}
+
+const char * statusText(int n) {
+	if (n >= 0 && n < DICT_STATUS && dictStatus[n]) return dictStatus[n];
+	return "(No message available)";
+}
+
@@ -0,0 +1,77 @@
+/* FRONIUS shared memory snapshot - for local programs that want the latest readings */
+/* .. and the multicast datagram, for those on the network that want each one as it arrives */
+
+// The daemon for controller N maintains FRONIUS_SHMNAME (with %d = N) and rewrites it as each
+// value arrives. Map it read-only and copy out with a seqlock:
+//
+//	do {
+//		while ((seq = shm->seq) & 1) ;		// writer active
+//		__sync_synchronize();
+//		copy = *shm;						// or just the fields required
+//		__sync_synchronize();
+//	} while (seq != shm->seq);
+//
+// Check magic and version before use. Values are in the same order and units as the
+// data line: watts, energy total (Wh), energy today, energy year, Iac, Vac, Hz, Idc, Vdc.
+
+#ifndef FRONIUS_H
+#define FRONIUS_H
+
+#include <stdint.h>
+
+#define FRONIUS_SHMNAME "/dev/shm/fronius%d"
+#define FRONIUS_MAGIC 0x46524f4e	/* "FRON" */
+#define FRONIUS_VERSION 1
+#define FRONIUS_MAXINVERTERS 12
+#define FRONIUS_NUMVALS 9
+#define FRONIUS_MAXFAULTS 8
+
+struct fronius_fault {
+	int code;			// 0 = unused
+	int count;
+	double first;		// seconds since the epoch
+	double last;
+};
+
+struct fronius_inverter {
+	float value[FRONIUS_NUMVALS];
+	double updated[FRONIUS_NUMVALS];	// when each value was received, 0 = never
+	int devType;		// Fronius device type code, 0 = not known
+	int ratedPower;		// Watts, 0 = not known
+	struct fronius_fault fault[FRONIUS_MAXFAULTS];	// active faults
+};
+
+struct fronius_shm {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int size;			// sizeof(struct fronius_shm) as written
+	volatile unsigned int seq;	// odd while being written
+	int controller;
+	int pid;
+	unsigned int activeMask;	// bit n set if inverter n is active
+	int numInverters;
+	double updated;				// last time anything changed
+	struct fronius_inverter inv[FRONIUS_MAXINVERTERS];	// [0] is inverter 1
+};
+
+// With -o mcast:group:port[,ttl=n] the daemon sends one datagram per value the moment it is
+// accepted. Every field is big-endian; the value is an IEEE 754 float sent as its bit pattern.
+// seq counts every datagram the daemon sends, so a gap is a lost datagram; it restarts at 0 when
+// the daemon does. rxsec/rxusec is when the reply carrying the value arrived (the ts: of the data line).
+
+#define FRONIUS_MCAST_MAGIC 0x46524d43	/* "FRMC" */
+#define FRONIUS_MCAST_VERSION 1
+
+struct fronius_mcast {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t controller;
+	uint8_t inverter;	// 1 .. FRONIUS_MAXINVERTERS
+	uint8_t index;		// 0 = watts .. 8 = Vdc, as value[] above
+	uint32_t seq;
+	uint32_t rxsec;
+	uint32_t rxusec;
+	uint32_t value;
+};
+
+#endif
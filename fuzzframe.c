@@ -0,0 +1,263 @@
+/* FUZZFRAME - fuzz and stress test for the Fronius frame parser */
+
+// Built on the build host with 'make fuzz'. fronius.c is included whole with its main() renamed,
+// so frameLength() and processPacket() are the real ones, called in process with no bus thread.
+//
+// fuzzframe [-f bursts] [-s megabytes] [-r seed] [-t]
+// -f: bursts of mutated and random bytes, split and decoded as the bus thread and main loop do.
+//     Build with FUZZFLAGS including -fsanitize=address,undefined (the default) to catch bad reads.
+// -s: megabytes of valid frames mixed with garbage, fed through as fast as possible. Reports
+//     frames/s, valid frames lost, and the worst time from garbage to the next good frame.
+//     Use FUZZFLAGS=-O2 for figures that mean anything.
+// -t: every tracepoint on, as Tracepoints all. Compare -s figures with and without to see what they cost.
+// Every run also checks that a server connection which closes is reconnected, with a socketpair
+// standing in for the server.
+
+#define main fronius_main
+#define openSockets testOpenSockets
+#include "fronius.c"
+#undef openSockets
+#undef main
+#include <signal.h>
+
+static unsigned int seed = 1;
+static unsigned int rnd(void) {		// xorshift: repeatable on every platform
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***********/
+/* MKFRAME */
+/***********/
+static int mkframe(unsigned char * p, int dev, int num, int cmd, int len, unsigned char * d) {
+	int i, sum = len + dev + num + cmd;
+	p[0] = p[1] = p[2] = 0x80;
+	p[3] = len; p[4] = dev; p[5] = num; p[6] = cmd;
+	for (i = 0; i < len; i++)
+		sum += p[7 + i] = d[i];
+	p[7 + len] = sum & 0xFF;
+	return len + 8;
+}
+
+/*************/
+/* GOODFRAME */
+/*************/
+static int goodFrame(unsigned char * p) {
+	// A reply the main loop would expect: mostly values, some active inverter lists
+	unsigned char d[MAXINVERTERS];
+	int i;
+	if (rnd() % 16 == 0) {
+		for (i = 0; i < MAXINVERTERS; i++) d[i] = i + 1;
+		return mkframe(p, 0, 0, GETACTIVEINVERTERS, MAXINVERTERS, d);
+	}
+	i = VARSTART + rnd() % (VAREND - VARSTART + 1);
+	d[0] = rnd() % 16; d[1] = rnd(); d[2] = exponent[i - VARSTART];
+	return mkframe(p, 1, 1 + rnd() % MAXINVERTERS, i, 3, d);
+}
+
+/*********/
+/* SPLIT */
+/*********/
+static int split(unsigned char * burst, int count) {
+	// As busThread splits a burst and the main loop hands each frame to processPacket.
+	// Return how many were accepted.
+	int i, len, ok = 0;
+	for (i = 0; i < count; i += len) {
+		len = frameLength(burst + i, count - i);
+		if (len <= 0 || len > count - i) {
+			fprintf(stderr, "frameLength %d with %d left\n", len, count - i);
+			abort();
+		}
+		bzero(data.buf, sizeof(data.buf));
+		memcpy(data.buf, burst + i, len);
+		data.count = len;
+		staticInfo.commandComplete = 0;
+		processPacket(data.buf);
+		if (staticInfo.commandComplete) ok++;
+	}
+	return ok;
+}
+
+/********/
+/* FUZZ */
+/********/
+static void fuzz(int bursts) {
+	unsigned char burst[BUFSIZE];
+	int n, count, i, ok = 0;
+	double t = now();
+
+	for (n = 0; n < bursts; n++) {
+		count = 0;
+		switch (rnd() % 4) {
+			case 0:		// Pure noise, often with a header in it
+				count = 1 + rnd() % BUFSIZE;
+				for (i = 0; i < count; i++)
+					burst[i] = rnd() % 3 ? rnd() : 0x80;
+				break;
+			case 1:		// Frames of any command and length byte, checksum right or wrong
+				while (count + 8 <= BUFSIZE) {
+					unsigned char d[BUFSIZE];
+					int len = rnd() % (BUFSIZE - 8 - count + 1), start = count;
+					for (i = 0; i < len; i++) d[i] = rnd();
+					count += mkframe(burst + count, rnd() % 3, rnd() % 256, rnd() % 32, len, d);
+					if (rnd() % 2) burst[count - 1 - rnd() % 4] ^= 1 << rnd() % 8;
+					if (rnd() % 3 == 0) burst[start + 3] = rnd();	// lie about the length
+					if (rnd() % 2) break;
+				}
+				break;
+			default:	// Good frames, then mutate: truncate, flip bits, insert bytes
+				while (count + 8 + MAXINVERTERS <= BUFSIZE && (count == 0 || rnd() % 2))
+					count += goodFrame(burst + count);
+				for (i = rnd() % 4; i > 0; i--)
+					burst[rnd() % count] ^= 1 << rnd() % 8;
+				if (rnd() % 4 == 0) count = 1 + rnd() % count;
+				if (rnd() % 4 == 0 && count < BUFSIZE) {
+					i = rnd() % count;
+					memmove(burst + i + 1, burst + i, count - i);
+					burst[i] = rnd();
+					count++;
+				}
+		}
+		staticInfo.currentSequence = rnd() % 2 ? GetVals : Refresh;
+		staticInfo.commandIndex = VARSTART + rnd() % (VAREND - VARSTART + 1);
+		staticInfo.commandLimit = VAREND;
+		staticInfo.target = 1 + rnd() % MAXINVERTERS;
+		staticInfo.refreshMask = rnd() & 0x1ff;
+		ok += split(burst, count);
+	}
+	printf("fuzz: %d bursts, %d frames accepted, %.2f s, no crashes\n", bursts, ok, now() - t);
+}
+
+/**********/
+/* STRESS */
+/**********/
+static void stress(int megabytes) {
+	// Bursts of one or two good frames, a quarter of them with garbage ahead, behind or
+	// through them. A frame counts as lost if it arrived intact but wasn't accepted.
+	unsigned char burst[BUFSIZE];
+	long bytes = 0, limit = megabytes * 1048576L, sent = 0, got = 0, resyncs = 0;
+	int count, good, i, n, dirty = 0;
+	double t = now(), t1, start = 0, worst = 0, total = 0;
+
+	staticInfo.currentSequence = GetVals;
+	staticInfo.commandIndex = VARSTART;
+	staticInfo.commandLimit = VAREND;
+	while (bytes < limit) {
+		count = good = 0;
+		if (rnd() % 4 == 0) {		// garbage first
+			n = 1 + rnd() % 8;
+			for (i = 0; i < n; i++) burst[count++] = rnd() % 4 ? rnd() : 0x80;
+			if (!dirty) { dirty = 1; start = now(); }
+		}
+		for (n = 1 + rnd() % 2; n > 0 && count + 8 + MAXINVERTERS <= BUFSIZE; n--) {
+			count += goodFrame(burst + count);
+			good++;
+		}
+		if (rnd() % 8 == 0 && count < BUFSIZE) {	// then a frame cut short
+			unsigned char cut[BUFSIZE];
+			n = goodFrame(cut) / 2;
+			if (count + n > BUFSIZE) n = BUFSIZE - count;
+			memcpy(burst + count, cut, n);
+			count += n;
+			if (!dirty) { dirty = 1; start = now(); }
+		}
+		sent += good;
+		n = split(burst, count);
+		got += n;
+		if (dirty && n) {	// first good frame after garbage
+			t1 = now() - start;
+			if (t1 > worst) worst = t1;
+			total += t1;
+			resyncs++;
+			dirty = 0;
+		}
+		bytes += count;
+	}
+	t = now() - t;
+	printf("stress: %.1f MB, %ld frames in %.2f s = %.0f frames/s, %.1f MB/s\n",
+		   bytes / 1048576.0, got, t, got / t, bytes / 1048576.0 / t);
+	printf("stress: %ld of %ld valid frames lost; %ld resyncs, worst %.1f us, mean %.2f us\n",
+		   sent - got, sent, resyncs, worst * 1e6, resyncs ? total / resyncs * 1e6 : 0.0);
+}
+
+/*******************/
+/* TESTOPENSOCKETS */
+/*******************/
+static int peer = -1;		// the server's end of sockfd[0]
+static int opens = 0, refuse = 0;
+int testOpenSockets(int start, int num, char * logon, char * rev, char * progname, int flag) {
+	// One socketpair for connection start; leave sockfd alone if refusing
+	int sv[2];
+	opens++;
+	if (refuse || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return 1;
+	sockfd[start] = sv[0];
+	peer = sv[1];
+	return 0;
+}
+
+/*************/
+/* RECONNECT */
+/*************/
+static void reconnect(void) {
+	// The server closes with a message half sent, then talks on the new connection
+	int fd, nfd, i, run = 1;
+	signal(SIGPIPE, SIG_IGN);
+	testOpenSockets(0, 1, "", "", "", 0);
+	fd = sockfd[0];
+	write(peer, "\0\012GetLa", 7);
+	for (i = 0; i < 2; i++) processSocket(0);
+	if (reader[0].have != 7) { fprintf(stderr, "reconnect: have %d, expected 7\n", reader[0].have); abort(); }
+	close(peer);
+	if (processSocket(0) != 1 || opens != 2 || reader[0].have != 0 || sockfd[0] < 0) {
+		fprintf(stderr, "reconnect: not reconnected (opens %d have %d fd %d)\n", opens, reader[0].have, sockfd[0]);
+		abort();
+	}
+	nfd = sockfd[0];
+	write(peer, "\0\004exit", 6);
+	for (i = 0; i < 3 && run; i++) run = processSocket(0);
+	if (run) { fprintf(stderr, "reconnect: exit on the new connection not seen\n"); abort(); }
+	refuse = 1;		// Now the server has gone for good
+	close(peer);
+	if (processSocket(0) != 0) { fprintf(stderr, "reconnect: should shut down when it can't reconnect\n"); abort(); }
+	printf("reconnect: old fd %d, new fd %d, shut down when refused\n", fd, nfd);
+	for (i = 0; i < MAXINVERTERS; i++)
+		sockfd[i] = fileno(logfp);
+}
+
+int main(int argc, char *argv[]) {
+	int bursts = 100000, megabytes = 16, op, i;
+
+	while ((op = getopt(argc, argv, "f:s:r:t")) != EOF)
+		switch (op) {
+			case 'f': bursts = atoi(optarg); break;
+			case 's': megabytes = atoi(optarg); break;
+			case 'r': seed = strtoul(optarg, NULL, 0); if (!seed) seed = 1; break;
+			case 't': tpMask = TP_ALL; break;
+			default: fprintf(stderr, "Usage: fuzzframe [-f bursts] [-s megabytes] [-r seed] [-t]\n"); return 1;
+		}
+	// Enough of the daemon's state for processPacket: every inverter active, output to nowhere
+	noserver = 1;
+	logfp = fopen("/dev/null", "w");
+	servers = 255;		// so a stray inverter number is rejected, not FATAL
+	multiplex = 1;
+	sinkAdd("mcp");
+	for (i = 0; i < MAXINVERTERS; i++) {
+		inverter[i] = i + 1;
+		sockfd[i] = fileno(logfp);
+	}
+	numInverters = MAXINVERTERS;
+	numsockets = 1;
+	printf("seed %u\n", seed);
+	reconnect();
+	if (bursts) fuzz(bursts);
+	if (megabytes) stress(megabytes);
+	return 0;
+}
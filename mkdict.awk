@@ -0,0 +1,68 @@
+# mkdict.awk - build froniusdict.h from fronius.dict
+# awk -f mkdict.awk fronius.dict > froniusdict.h
+# Plain awk: no gawk extensions, so it runs under busybox too.
+# Every table is an array indexed by the code itself, so a lookup is one bounds check and a load.
+
+function text(n,	t, i) {		# the rest of the line after n fields, as a C string
+	t = $0
+	for (i = 0; i < n; i++)
+		sub(/^[ \t]*[^ \t]+[ \t]+/, "", t)
+	sub(/[ \t\r]+$/, "", t)
+	gsub(/\\/, "\\\\", t)
+	gsub(/"/, "\\\"", t)
+	return "\"" t "\""
+}
+
+function entry(kind, line) {
+	body[kind] = body[kind] "\t[" $2 "] = " line ",\n"
+	if ($2 + 0 >= size[kind]) size[kind] = $2 + 1
+}
+
+/^[ \t]*(#|$)/ { next }
+
+$1 == "device" {
+	entry("device", text(3))
+	entry("rated", $3)
+	next
+}
+$1 == "status" || $1 == "protocol" || $1 == "command" || $1 == "system" {
+	entry($1, text(2))
+	next
+}
+$1 == "tracepoint" {
+	entry("tpname", "\"" $3 "\"")
+	entry("tpformat", text(3))
+	next
+}
+{
+	printf("%s:%d: unknown kind '%s'\n", FILENAME, FNR, $1) > "/dev/stderr"
+	bad = 1
+	exit 1
+}
+
+END {
+	if (bad) exit 1
+	print "/* froniusdict.h - generated from fronius.dict by mkdict.awk. Do not edit. */"
+	print ""
+	print "static const char * const dictDevice[256] = {\t// Device Type"
+	printf("%s};\n", body["device"])
+	print "static const int dictRated[256] = {\t// Watts, 0 = not known"
+	printf("%s};\n", body["rated"])
+	printf("#define DICT_STATUS %d\n", size["status"])
+	print "static const char * const dictStatus[DICT_STATUS] = {\t// ERRORSTATE code"
+	printf("%s};\n", body["status"])
+	printf("#define DICT_PROTOCOL %d\n", size["protocol"])
+	print "static const char * const dictProtocol[DICT_PROTOCOL] = {\t// PROTOCOLERROR code"
+	printf("%s};\n", body["protocol"])
+	print "static const char * const CommandName[] = {\t// enum CommandType"
+	printf("%s};\n", body["command"])
+	print "static const char * const systemStr[] = {\t// systemType"
+	printf("%s};\n", body["system"])
+	print "#ifndef TINY"
+	printf("#define DICT_TRACE %d\n", size["tpname"])
+	print "static const char * const dictTraceName[DICT_TRACE] = {\t// enum TracePoint"
+	printf("%s};\n", body["tpname"])
+	print "static const char * const dictTraceFormat[DICT_TRACE] = {\t// .. and how fronius -T prints it"
+	printf("%s};\n", body["tpformat"])
+	print "#endif"
+}